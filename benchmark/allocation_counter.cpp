@@ -0,0 +1,56 @@
+// Replaces the global allocation functions to count calls, in a translation unit of its own so the compiler never
+// sees malloc and free through the replaced operators it inlines.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace {
+	std::atomic<std::uint64_t> allocations{0};
+	thread_local bool counting = true;
+}
+
+std::uint64_t allocation_count()
+{
+	return allocations.load(std::memory_order_relaxed);
+}
+
+// whether allocations made by the calling thread are counted, so the threads producing the load can stay out of it
+void count_allocations(const bool enabled)
+{
+	counting = enabled;
+}
+
+void* operator new(std::size_t size)
+{
+	if (counting)
+		allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* memory = std::malloc(size == 0 ? 1 : size)) return memory;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete[](void* memory, std::size_t) noexcept
+{
+	std::free(memory);
+}
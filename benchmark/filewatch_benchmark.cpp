@@ -0,0 +1,295 @@
+// Drives filewatch::FileWatch with synthetic file storms and reports how the pipeline copes, no game needed.
+// The callback does what the module's does (intern the path, queue it for another thread) and a consumer thread
+// drains the queue on a fixed tick the way the Think hook would.
+//
+//   filewatch_benchmark [--count N] [--tick ms] [--backend native|fanotify] [--delivery direct|threaded]
+//                       [--scenario all|create|modify|rename|tree|delete] [--dir path]
+
+#include <filewatch.hpp>
+#include <change_queue.hpp>
+#include <latency_histogram.hpp>
+#include <path_table.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// defined in allocation_counter.cpp, allocations made by every thread that did not opt out
+std::uint64_t allocation_count();
+void count_allocations(bool enabled);
+
+namespace {
+	namespace fs = std::filesystem;
+	using filewatch::Clock;
+	using filewatch::Event;
+	using filewatch::PathId;
+
+	struct Settings
+	{
+		std::size_t count = 10000;
+		int tick_ms = 15;
+		filewatch::Options options{};
+		std::string scenario = "all";
+		fs::path directory = fs::temp_directory_path() / "filewatch_benchmark";
+	};
+
+	// A storm writes files named f<number> (r<number> once renamed) and waits for one event of type expected for each.
+	struct Scenario
+	{
+		const char* name;
+		Event expected;
+	};
+
+	struct Result
+	{
+		std::uint64_t events = 0;  // every event that came through, expected or not
+		std::uint64_t matched = 0; // files the expected event was seen for
+		std::uint64_t lost = 0;
+		std::uint64_t overflows = 0;
+		std::uint64_t allocations = 0;
+		double seconds = 0;        // first operation to last event
+		filewatch::LatencyHistogram::Summary end_to_end;  // file operation to the consumer seeing it
+		filewatch::LatencyHistogram::Summary kernel;      // file operation to the read reporting it returning
+	};
+
+	// the number in f123 or r123, SIZE_MAX when the name isn't one of ours
+	std::size_t file_number(const std::string_view path)
+	{
+		const std::string_view name = filewatch::PathFilter::file_name(path);
+		if (name.size() < 2 || (name[0] != 'f' && name[0] != 'r')) return SIZE_MAX;
+
+		std::size_t number = 0;
+		for (const char character : name.substr(1))
+		{
+			if (character < '0' || character > '9') return SIZE_MAX;
+			number = number * 10 + static_cast<std::size_t>(character - '0');
+		}
+		return number;
+	}
+
+	void write_file(const fs::path& path, const std::size_t size)
+	{
+		std::ofstream file(path, std::ios::binary | std::ios::app);
+		const std::string contents(size, 'x');
+		file.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+	}
+
+	// where file number lives for the tree storm, eight levels deep with files spread over every level
+	fs::path tree_path(const fs::path& root, const std::size_t number)
+	{
+		fs::path path = root / "tree";
+		for (std::size_t level = 0; level < number % 8; ++level)
+			path /= "d" + std::to_string(level);
+		return path / ("f" + std::to_string(number));
+	}
+
+	class Benchmark
+	{
+	public:
+		explicit Benchmark(Settings settings) :
+			_settings(std::move(settings)),
+			_queue([](const PathId path) { return path; }),
+			_seen(_settings.count),
+			_operations(_settings.count)
+		{
+		}
+
+		int run()
+		{
+			std::error_code error;
+			fs::remove_all(_settings.directory, error);
+			fs::create_directories(_settings.directory / "flat");
+			fs::create_directories(_settings.directory / "tree");
+
+			filewatch::FileWatch watch(_settings.directory.string(), [this](const filewatch::FileEvent& event) {
+				// what the module's callback does, one intern and one push
+				const PathId path = _paths.intern(event.path);
+				const PathId old_path = event.old_path.empty() ? 0 : _paths.intern(event.old_path);
+				_queue.push(path, event.type, old_path, event.captured);
+			}, _settings.options);
+
+			std::printf("%s backend, %s delivery, %zu files, %d ms ticks, in %s\n",
+				watch.backend() == filewatch::Backend::FANOTIFY ? "fanotify" : "native",
+				_settings.options.delivery == filewatch::Delivery::DIRECT ? "direct" : "threaded",
+				_settings.count, _settings.tick_ms, _settings.directory.string().c_str());
+			std::printf("%-8s %10s %10s %8s %6s %12s %10s %10s %10s %10s %10s\n",
+				"storm", "events", "matched", "lost", "ovf", "events/s", "p50 ms", "p99 ms", "max ms", "kernel p99", "allocs/ev");
+
+			// the watch only covers the whole tree once its walk is done
+			while (!watch.ready(0))
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+			const bool all = _settings.scenario == "all";
+			const auto create = [this](const std::size_t i) { write_file(flat(i), 0); };
+			if (all || _settings.scenario == "create")
+				report({ "create", Event::CREATED }, create);
+			else if (_settings.scenario == "modify" || _settings.scenario == "rename" || _settings.scenario == "delete")
+				storm({ "create", Event::CREATED }, create); // the files these work on, not reported
+			if (all || _settings.scenario == "modify")
+				report({ "modify", Event::CHANGED }, [this](const std::size_t i) { for (int burst = 0; burst < 4; ++burst) write_file(flat(i), 64); });
+			if (all || _settings.scenario == "rename")
+				report({ "rename", Event::RENAMED }, [this](const std::size_t i) {
+					fs::rename(flat(i), _settings.directory / "flat" / ("r" + std::to_string(i)));
+				});
+			if (all || _settings.scenario == "tree")
+				report({ "tree", Event::CREATED }, [this](const std::size_t i) {
+					const fs::path path = tree_path(_settings.directory, i);
+					fs::create_directories(path.parent_path());
+					write_file(path, 16);
+				});
+			if (all || _settings.scenario == "delete")
+				report({ "delete", Event::DELETED }, [this](const std::size_t i) {
+					std::error_code ignored;
+					fs::remove(_settings.directory / "flat" / ("r" + std::to_string(i)), ignored);
+					fs::remove(flat(i), ignored);
+				});
+
+			fs::remove_all(_settings.directory, error);
+			return 0;
+		}
+
+	private:
+		fs::path flat(const std::size_t number) const
+		{
+			return _settings.directory / "flat" / ("f" + std::to_string(number));
+		}
+
+		template <typename Operation>
+		void report(const Scenario& scenario, const Operation& operation)
+		{
+			const Result result = storm(scenario, operation);
+			std::printf("%-8s %10llu %10llu %8llu %6llu %12.0f %10.3f %10.3f %10.3f %10.3f %10.2f\n",
+				scenario.name, static_cast<unsigned long long>(result.events), static_cast<unsigned long long>(result.matched),
+				static_cast<unsigned long long>(result.lost), static_cast<unsigned long long>(result.overflows),
+				result.seconds > 0 ? static_cast<double>(result.events) / result.seconds : 0.0,
+				result.end_to_end.p50 * 1000, result.end_to_end.p99 * 1000, result.end_to_end.max * 1000, result.kernel.p99 * 1000,
+				result.events > 0 ? static_cast<double>(result.allocations) / static_cast<double>(result.events) : 0.0);
+		}
+
+		template <typename Operation>
+		Result storm(const Scenario& scenario, const Operation& operation)
+		{
+			std::fill(_seen.begin(), _seen.end(), false);
+			filewatch::LatencyHistogram end_to_end;
+			filewatch::LatencyHistogram kernel;
+			Result result;
+
+			// the storm runs on its own thread while this one plays the game thread
+			const std::uint64_t allocations_before = allocation_count();
+			const Clock::time_point started = Clock::now();
+			std::atomic_bool written{false};
+			std::thread writer([this, &operation, &written]() {
+				count_allocations(false); // what file operations allocate is not the pipeline's cost
+				for (std::size_t i = 0; i < _settings.count; ++i)
+				{
+					_operations[i] = Clock::now();
+					operation(i);
+				}
+				written = true;
+			});
+
+			Clock::time_point last_event = started;
+			while (true)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(_settings.tick_ms));
+				const Clock::time_point now = Clock::now();
+
+				bool any = false;
+				_queue.drain([&](const PathId path, const Event type, const PathId, const Clock::time_point captured) {
+					any = true;
+					++result.events;
+					if (type == Event::QUEUE_OVERFLOW) ++result.overflows;
+
+					// a rename that could not be paired still tells the new name arrived
+					const bool expected = type == scenario.expected || (scenario.expected == Event::RENAMED && type == Event::RENAMED_NEW);
+					if (!expected) return;
+
+					const std::size_t number = file_number(_paths.path(path));
+					if (number >= _settings.count || _seen[number]) return;
+
+					_seen[number] = true;
+					++result.matched;
+					end_to_end.record(now - _operations[number]);
+					kernel.record(captured - _operations[number]);
+				});
+
+				// done once everything arrived, or once nothing came for a second after the last file was written
+				if (any) last_event = now;
+				if (result.matched >= _settings.count) break;
+				if (written && now - last_event > std::chrono::seconds(1)) break;
+			}
+			writer.join();
+
+			result.seconds = std::chrono::duration<double>(last_event - started).count();
+			result.lost = _settings.count - result.matched;
+			result.allocations = allocation_count() - allocations_before;
+			result.end_to_end = end_to_end.summary();
+			result.kernel = kernel.summary();
+			return result;
+		}
+
+		Settings _settings;
+		filewatch::PathTable _paths;
+		filewatch::ChangeQueue<PathId> _queue;
+		std::vector<bool> _seen;                      // only touched by the consumer
+		std::vector<Clock::time_point> _operations;   // when file number was written to, set before it happens
+	};
+
+	bool parse_arguments(int argc, char** argv, Settings& settings)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string argument = argv[i];
+			const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+			if (value == nullptr) return false;
+			++i;
+
+			if (argument == "--count")
+				settings.count = std::strtoull(value, nullptr, 10);
+			else if (argument == "--tick")
+				settings.tick_ms = std::atoi(value);
+			else if (argument == "--backend")
+				settings.options.backend = std::strcmp(value, "fanotify") == 0 ? filewatch::Backend::FANOTIFY : filewatch::Backend::NATIVE;
+			else if (argument == "--delivery")
+				settings.options.delivery = std::strcmp(value, "threaded") == 0 ? filewatch::Delivery::THREADED : filewatch::Delivery::DIRECT;
+			else if (argument == "--scenario")
+				settings.scenario = value;
+			else if (argument == "--dir")
+				settings.directory = value;
+			else
+				return false;
+		}
+
+		return settings.count > 0 && settings.tick_ms > 0;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Settings settings;
+	settings.options.delivery = filewatch::Delivery::DIRECT; // what the module uses
+	settings.options.on_error = [](const std::string& message) { std::fprintf(stderr, "%s\n", message.c_str()); };
+	if (!parse_arguments(argc, argv, settings))
+	{
+		std::fprintf(stderr, "usage: %s [--count N] [--tick ms] [--backend native|fanotify] [--delivery direct|threaded]\n"
+			"       [--scenario all|create|modify|rename|tree|delete] [--dir path]\n", argv[0]);
+		return 1;
+	}
+
+	try
+	{
+		return Benchmark(std::move(settings)).run();
+	}
+	catch (const std::exception& exception)
+	{
+		std::fprintf(stderr, "benchmark failed: %s\n", exception.what());
+		return 1;
+	}
+}
@@ -0,0 +1,358 @@
+#ifndef CHANGE_JOURNAL_H
+#define CHANGE_JOURNAL_H
+
+#ifdef _WIN32
+#include <windows.h>
+#elif __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // __unix__
+
+#include <unicode.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+
+namespace filewatch {
+	// last known state of an entry under a root
+	struct EntryState
+	{
+		std::int64_t modified = 0;
+		std::uint64_t size = 0;
+		std::uint64_t inode = 0;
+		bool directory = false;
+	};
+
+	// Memory mapped file that keeps the state of every entry under a root across runs, so what changed while nothing
+	// was watching can be told without knowing anything but the disk. Changes are appended as records, which only
+	// count once the header's end has moved past them: a process dying halfway through a write loses that one record.
+	// Writes go straight into the mapping without a system call, the kernel writes them back on its own, crashes of the
+	// process included. The layout is native endian, a journal is not meant to move between machines.
+	// Not thread safe.
+	class ChangeJournal
+	{
+	public:
+		using State = std::unordered_map<std::string, EntryState>;
+
+		// Opens file, creating it if need be, for the root with the canonical path root. What it held for that root
+		// goes into previous and intact() tells whether there was anything, a journal of another root, of an older
+		// layout or a damaged one is started over. Throws std::system_error.
+		ChangeJournal(const std::string& file, const std::string& root, State& previous) : _root(root)
+		{
+#ifdef _WIN32
+			_file = CreateFileW(widen(file).c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (_file == INVALID_HANDLE_VALUE)
+				throw std::system_error(GetLastError(), std::system_category());
+
+			LARGE_INTEGER size{};
+			if (!GetFileSizeEx(_file, &size))
+			{
+				const DWORD error = GetLastError();
+				close();
+				throw std::system_error(error, std::system_category());
+			}
+			const std::uint64_t file_size = static_cast<std::uint64_t>(size.QuadPart);
+#elif __unix__
+			_file = ::open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+			if (_file < 0)
+				throw std::system_error(errno, std::system_category());
+
+			struct stat statbuf = {};
+			if (fstat(_file, &statbuf) != 0)
+			{
+				const int error = errno;
+				close();
+				throw std::system_error(error, std::system_category());
+			}
+			const std::uint64_t file_size = static_cast<std::uint64_t>(statbuf.st_size);
+#endif // __unix__
+
+			try
+			{
+				if (file_size > 0)
+					map(file_size);
+				_intact = load(previous);
+				if (!_intact)
+				{
+					previous.clear();
+					start_over();
+				}
+			}
+			catch (...)
+			{
+				close();
+				throw;
+			}
+		}
+
+		// the file is cut down to what is in use
+		~ChangeJournal()
+		{
+			close();
+		}
+
+		ChangeJournal(const ChangeJournal&) = delete;
+		ChangeJournal& operator=(const ChangeJournal&) = delete;
+
+		// whether the journal held the state of the root when it was opened
+		bool intact() const
+		{
+			return _intact;
+		}
+
+		// records the state of path, nullptr for an entry that is gone; throws std::system_error when the file can't grow
+		void record(const std::string_view path, const EntryState* state)
+		{
+			append(path, state);
+			set_end(_end);
+		}
+
+		// replaces everything recorded so far with state; until it is done the journal reads as damaged, never as half of it
+		void rewrite(const State& state)
+		{
+			set_end(0);
+			_end = data_start();
+			_records = 0;
+			for (const auto& entry : state)
+				append(entry.first, &entry.second);
+			set_end(_end);
+		}
+
+		// records appended since the last rewrite, once this is well past the number of entries a rewrite() pays off
+		std::uint64_t records() const
+		{
+			return _records;
+		}
+
+	private:
+		static constexpr char _magic[8] = { 'F', 'W', 'J', 'O', 'U', 'R', 'N', 'L' };
+		static constexpr std::uint32_t _version = 1;
+		static constexpr std::uint64_t _minimum_capacity = 64 * 1024;
+
+		struct Header
+		{
+			char magic[8];
+			std::uint32_t version;
+			std::uint32_t root_size; // the root's canonical path follows the header
+			std::uint64_t end;       // where the valid records stop, 0 while a rewrite is in progress
+			std::uint64_t records;
+		};
+
+		enum Kind : std::uint32_t
+		{
+			FILE_ENTRY,
+			DIRECTORY_ENTRY,
+			REMOVED
+		};
+
+		// followed by path_size bytes of path, padded to 8
+		struct Record
+		{
+			std::uint32_t path_size;
+			std::uint32_t kind;
+			std::int64_t modified;
+			std::uint64_t size;
+			std::uint64_t inode;
+		};
+
+		static std::uint64_t align(const std::uint64_t offset)
+		{
+			return (offset + 7) & ~std::uint64_t(7);
+		}
+
+		std::uint64_t data_start() const
+		{
+			return align(sizeof(Header) + _root.size());
+		}
+
+		bool load(State& previous)
+		{
+			Header header{};
+			if (_capacity < sizeof(Header)) return false;
+
+			std::memcpy(&header, _view, sizeof(header));
+			if (std::memcmp(header.magic, _magic, sizeof(_magic)) != 0 || header.version != _version) return false;
+			if (header.root_size != _root.size() || _capacity < sizeof(Header) + _root.size()) return false;
+			if (std::memcmp(_view + sizeof(Header), _root.data(), _root.size()) != 0) return false;
+			if (header.end < data_start() || header.end > _capacity) return false;
+
+			std::uint64_t offset = data_start();
+			while (offset < header.end)
+			{
+				Record record{};
+				if (header.end - offset < sizeof(Record)) return false;
+				std::memcpy(&record, _view + offset, sizeof(record));
+
+				const std::uint64_t path_offset = offset + sizeof(Record);
+				if (record.path_size > header.end - path_offset) return false;
+
+				std::string path(_view + path_offset, record.path_size);
+				if (record.kind == REMOVED)
+				{
+					previous.erase(path);
+				}
+				else
+				{
+					EntryState& state = previous[std::move(path)];
+					state.modified = record.modified;
+					state.size = record.size;
+					state.inode = record.inode;
+					state.directory = record.kind == DIRECTORY_ENTRY;
+				}
+				offset = align(path_offset + record.path_size);
+			}
+
+			_end = header.end;
+			_records = header.records;
+			return true;
+		}
+
+		void start_over()
+		{
+			reserve(data_start());
+
+			Header header{};
+			std::memcpy(header.magic, _magic, sizeof(_magic));
+			header.version = _version;
+			header.root_size = static_cast<std::uint32_t>(_root.size());
+			header.end = 0;
+			std::memcpy(_view, &header, sizeof(header));
+			std::memcpy(_view + sizeof(Header), _root.data(), _root.size());
+
+			_end = data_start();
+			_records = 0;
+			set_end(_end);
+		}
+
+		void append(const std::string_view path, const EntryState* state)
+		{
+			const std::uint64_t next = align(_end + sizeof(Record) + path.size());
+			reserve(next);
+
+			Record record{};
+			record.path_size = static_cast<std::uint32_t>(path.size());
+			record.kind = state == nullptr ? REMOVED : state->directory ? DIRECTORY_ENTRY : FILE_ENTRY;
+			if (state != nullptr)
+			{
+				record.modified = state->modified;
+				record.size = state->size;
+				record.inode = state->inode;
+			}
+			std::memcpy(_view + _end, &record, sizeof(record));
+			std::memcpy(_view + _end + sizeof(Record), path.data(), path.size());
+
+			_end = next;
+			++_records;
+		}
+
+		// the end goes in last, what it covers has to be written by then
+		void set_end(const std::uint64_t end)
+		{
+			std::memcpy(_view + offsetof(Header, records), &_records, sizeof(_records));
+			std::memcpy(_view + offsetof(Header, end), &end, sizeof(end));
+		}
+
+		// grows the file and the mapping to hold at least size bytes, doubling so appends stay cheap
+		void reserve(const std::uint64_t size)
+		{
+			if (size <= _capacity) return;
+
+			std::uint64_t capacity = std::max(_capacity * 2, _minimum_capacity);
+			while (capacity < size)
+				capacity *= 2;
+
+			unmap();
+#ifdef __unix__
+			// allocated up front, a write into a sparse mapping on a full disk would be a SIGBUS instead of an error
+			const int error = posix_fallocate(_file, 0, static_cast<off_t>(capacity));
+			if (error != 0)
+				throw std::system_error(error, std::system_category());
+#endif // __unix__
+			map(capacity);
+		}
+
+		void map(const std::uint64_t capacity)
+		{
+#ifdef _WIN32
+			// a mapping larger than the file grows the file along with it
+			_mapping = CreateFileMappingA(_file, nullptr, PAGE_READWRITE, static_cast<DWORD>(capacity >> 32), static_cast<DWORD>(capacity), nullptr);
+			if (_mapping == nullptr)
+				throw std::system_error(GetLastError(), std::system_category());
+
+			void* view = MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, static_cast<SIZE_T>(capacity));
+			if (view == nullptr)
+			{
+				const DWORD error = GetLastError();
+				CloseHandle(_mapping);
+				_mapping = nullptr;
+				throw std::system_error(error, std::system_category());
+			}
+#elif __unix__
+			void* view = mmap(nullptr, static_cast<std::size_t>(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, _file, 0);
+			if (view == MAP_FAILED)
+				throw std::system_error(errno, std::system_category());
+#endif // __unix__
+
+			_view = static_cast<char*>(view);
+			_capacity = capacity;
+		}
+
+		void unmap()
+		{
+			if (_view == nullptr) return;
+
+#ifdef _WIN32
+			UnmapViewOfFile(_view);
+			CloseHandle(_mapping);
+			_mapping = nullptr;
+#elif __unix__
+			munmap(_view, static_cast<std::size_t>(_capacity));
+#endif // __unix__
+			_view = nullptr;
+		}
+
+		void close()
+		{
+			const bool mapped = _view != nullptr;
+			unmap();
+#ifdef _WIN32
+			if (_file == INVALID_HANDLE_VALUE) return;
+
+			LARGE_INTEGER end{};
+			end.QuadPart = static_cast<LONGLONG>(_end);
+			if (mapped && SetFilePointerEx(_file, end, nullptr, FILE_BEGIN))
+				SetEndOfFile(_file);
+			CloseHandle(_file);
+			_file = INVALID_HANDLE_VALUE;
+#elif __unix__
+			if (_file < 0) return;
+
+			if (mapped && ftruncate(_file, static_cast<off_t>(_end)) != 0) {} // a journal left at its full capacity reads just the same
+			::close(_file);
+			_file = -1;
+#endif // __unix__
+		}
+
+		const std::string _root;
+#ifdef _WIN32
+		HANDLE _file = INVALID_HANDLE_VALUE;
+		HANDLE _mapping = nullptr;
+#elif __unix__
+		int _file = -1;
+#endif // __unix__
+		char* _view = nullptr;
+		std::uint64_t _capacity = 0; // bytes mapped, the file is at least as large
+		std::uint64_t _end = 0;      // where the next record goes
+		std::uint64_t _records = 0;
+		bool _intact = false;
+	};
+}
+#endif
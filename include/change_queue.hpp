@@ -0,0 +1,169 @@
+#ifndef CHANGE_QUEUE_H
+#define CHANGE_QUEUE_H
+
+#include <filewatch.hpp>
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace filewatch {
+	// Queue of changes between any number of producer threads and the one thread draining it, with an optional
+	// capacity so a consumer that stops draining (a long map load, a paused timer) can't make memory grow without bound.
+	// What happens to changes that don't fit is up to the QueuePolicy, and counted in counts().
+	// With COLLAPSE, changes that don't fit are kept as a single DIRTY change per directory instead, directory(path)
+	// tells which one a path is in. Every change keeps the time it was pushed with, a DIRTY one the first of its directory.
+	template <typename Key>
+	class ChangeQueue
+	{
+	public:
+		using Directory = std::function<Key(const Key& path)>;
+
+		explicit ChangeQueue(Directory directory) : _directory(std::move(directory)) {}
+
+		ChangeQueue(const ChangeQueue&) = delete;
+		ChangeQueue& operator=(const ChangeQueue&) = delete;
+
+		// capacity 0 for no limit; changes already queued past a smaller capacity stay until drained
+		void set_limit(const std::size_t capacity, const QueuePolicy policy)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_capacity = capacity;
+				_policy = policy;
+			}
+			_space.notify_all();
+		}
+
+		void push(const Key& path, const Event type, const Key& old_path, const Clock::time_point time)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			if (_closed) return;
+
+			if (_capacity > 0 && _queue.size() >= _capacity)
+			{
+				switch (_policy)
+				{
+					case QueuePolicy::BLOCK:
+						++_counts.blocked;
+						_space.wait(lock, [this] { return _closed || _capacity == 0 || _queue.size() < _capacity; });
+						if (_closed) return;
+						break;
+					case QueuePolicy::DROP_NEWEST:
+						++_counts.dropped;
+						return;
+					case QueuePolicy::DROP_OLDEST:
+						++_counts.dropped;
+						_queue.pop_front();
+						break;
+					case QueuePolicy::COLLAPSE:
+						++_counts.collapsed;
+						mark_dirty(path, time);
+						if (type == Event::RENAMED)
+							mark_dirty(old_path, time);
+						return;
+				}
+			}
+
+			_queue.push_back(Item{ path, type, old_path, time });
+		}
+
+		// Hands everything queued to output(path, type, old_path, time), the DIRTY changes last.
+		template <typename Output>
+		void drain(Output&& output)
+		{
+			std::deque<Item> items;
+			std::vector<Dirty> dirty;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				items.swap(_queue);
+				dirty.swap(_dirty_order);
+				_dirty.clear();
+			}
+			_space.notify_all();
+
+			for (const Item& item : items)
+				output(item.path, item.type, item.old_path, item.time);
+
+			for (const Dirty& directory : dirty)
+				output(directory.path, Event::DIRTY, Key(), directory.time);
+		}
+
+		DropCounts counts() const
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _counts;
+		}
+
+		// Producers waiting for room give up and nothing is queued anymore until reset(), so whatever waits on them can
+		// be joined without draining first.
+		void close()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_closed = true;
+			}
+			_space.notify_all();
+		}
+
+		std::size_t size() const
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _queue.size() + _dirty_order.size();
+		}
+
+		// back to an empty, open and unbounded queue with nothing counted
+		void reset()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_queue.clear();
+			_dirty.clear();
+			_dirty_order.clear();
+			_counts = DropCounts();
+			_capacity = 0;
+			_policy = QueuePolicy::DROP_OLDEST;
+			_closed = false;
+		}
+
+	private:
+		struct Item
+		{
+			Key path;
+			Event type;
+			Key old_path;
+			Clock::time_point time;
+		};
+
+		struct Dirty
+		{
+			Key path;
+			Clock::time_point time;
+		};
+
+		// _mutex must be held
+		void mark_dirty(const Key& path, const Clock::time_point time)
+		{
+			const Key directory = _directory(path);
+			if (_dirty.insert(directory).second)
+				_dirty_order.push_back(Dirty{ directory, time });
+		}
+
+		const Directory _directory;
+
+		mutable std::mutex _mutex;
+		std::condition_variable _space;
+		std::deque<Item> _queue;
+		std::unordered_set<Key> _dirty;
+		std::vector<Dirty> _dirty_order; // DIRTY changes go out in the order their directories overflowed
+		std::size_t _capacity = 0;
+		QueuePolicy _policy = QueuePolicy::DROP_OLDEST;
+		DropCounts _counts;
+		bool _closed = false;
+	};
+}
+#endif
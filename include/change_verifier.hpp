@@ -0,0 +1,270 @@
+#ifndef CHANGE_VERIFIER_H
+#define CHANGE_VERIFIER_H
+
+#include <filewatch.hpp>
+#include <content_hash.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace filewatch {
+	// Drops CHANGED events for files whose bytes did not actually change, e.g. touch-and-save or re-validation
+	// rewriting identical content. Runs on its own worker thread; every event passes through it in order, so
+	// verification never reorders events for a path.
+	//
+	// For each CHANGED the file is stat'ed first: unchanged modification time and size drop the event without
+	// reading anything, a different size forwards it without reading anything. Only a same-size rewrite is hashed
+	// (XXH64) and compared with the last known hash. Files larger than max_size are never read.
+	// The first CHANGED seen for a path is always forwarded, there is nothing to compare it to yet, but its hash is kept.
+	// Once catch_up events wait for the worker (a slow disk, a flood of writes), it stops reading files and forwards
+	// what it has unverified until it caught up, so the queue is drained at the speed of the output, not of the disk.
+	// The output may still block (a ChangeQueue with QueuePolicy::BLOCK), set_limit() bounds the queue for good then:
+	// changes that don't fit are handled like ChangeQueue does, except that COLLAPSE waits for room the way BLOCK
+	// does, there are no directories to collapse into this early on.
+	template <typename Key>
+	class ChangeVerifier
+	{
+	public:
+		using Resolver = std::function<std::string(const Key& path)>; // full path on disk of a key
+		using Output = std::function<void(const Key& path, const Event type, const Key& old_path, const Clock::time_point captured)>;
+
+		ChangeVerifier(Resolver resolver, Output output, const std::uint64_t max_size = 16 * 1024 * 1024, const std::size_t catch_up = 4096) :
+			_resolver(std::move(resolver)),
+			_output(std::move(output)),
+			_max_size(max_size),
+			_catch_up(catch_up)
+		{
+			_worker = std::thread([this]() { work(); });
+		}
+
+		// forwards whatever is still queued before returning, turning verification off must not lose events
+		~ChangeVerifier()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stop = true;
+			}
+			_cv.notify_all();
+			_space.notify_all();
+			_worker.join();
+		}
+
+		ChangeVerifier(const ChangeVerifier&) = delete;
+		ChangeVerifier& operator=(const ChangeVerifier&) = delete;
+
+		// capacity 0 for no limit; changes already queued past a smaller capacity stay until the worker takes them
+		void set_limit(const std::size_t capacity, const QueuePolicy policy)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_capacity = capacity;
+				_policy = policy;
+			}
+			_space.notify_all();
+		}
+
+		void push(const Key& path, const Event type, const Key& old_path, const Clock::time_point captured)
+		{
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				if (_capacity > 0 && _pending.size() >= _capacity)
+				{
+					// whatever waits is to go out unverified, the worker is too slow for it already
+					_overloaded = true;
+					switch (_policy)
+					{
+						case QueuePolicy::BLOCK:
+						case QueuePolicy::COLLAPSE:
+							++_counts.blocked;
+							_cv.notify_one();
+							_space.wait(lock, [this] { return _stop || _capacity == 0 || _pending.size() < _capacity; });
+							break;
+						case QueuePolicy::DROP_NEWEST:
+							++_counts.dropped;
+							return;
+						case QueuePolicy::DROP_OLDEST:
+							++_counts.dropped;
+							_pending.pop_front();
+							break;
+					}
+				}
+
+				_pending.push_back({ path, type, old_path, captured });
+				if (_catch_up > 0 && _pending.size() >= _catch_up)
+					_overloaded = true;
+			}
+			_cv.notify_one();
+		}
+
+		// what set_limit() had to give up so far, never anything collapsed
+		DropCounts counts() const
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _counts;
+		}
+
+		// CHANGED events dropped so far
+		std::uint64_t suppressed() const
+		{
+			return _suppressed;
+		}
+
+		// CHANGED events forwarded without being checked because too many were waiting
+		std::uint64_t unverified() const
+		{
+			return _unverified;
+		}
+
+	private:
+		struct Item
+		{
+			Key path;
+			Event type;
+			Key old_path;
+			Clock::time_point captured;
+		};
+
+		struct Fingerprint
+		{
+			std::int64_t modified = 0;
+			std::uint64_t size = 0;
+			std::uint64_t hash = 0;
+			bool hashed = false;
+		};
+
+		void work()
+		{
+			std::deque<Item> items;
+			while (true)
+			{
+				bool overloaded = false;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_cv.wait(lock, [this] { return _stop || !_pending.empty(); });
+					if (_pending.empty()) return;
+
+					items.swap(_pending);
+					overloaded = _overloaded;
+					_overloaded = false;
+				}
+				_space.notify_all();
+
+				for (const Item& item : items)
+				{
+					if (overloaded && item.type == Event::CHANGED)
+					{
+						// what is known about the file is stale now, the next change is taken as the first one
+						_fingerprints.erase(item.path);
+						++_unverified;
+						_output(item.path, item.type, item.old_path, item.captured);
+					}
+					else if (keep(item))
+						_output(item.path, item.type, item.old_path, item.captured);
+					else
+						++_suppressed;
+				}
+				items.clear();
+			}
+		}
+
+		bool keep(const Item& item)
+		{
+			switch (item.type)
+			{
+				case Event::CHANGED:
+					return verify(item.path);
+				case Event::DELETED:
+				case Event::RENAMED_OLD:
+					_fingerprints.erase(item.path);
+					return true;
+				case Event::RENAMED:
+				{
+					const auto found = _fingerprints.find(item.old_path);
+					if (found != _fingerprints.end())
+					{
+						const Fingerprint fingerprint = found->second;
+						_fingerprints.erase(found);
+						_fingerprints[item.path] = fingerprint;
+					}
+					return true;
+				}
+				default:
+					return true;
+			}
+		}
+
+		bool verify(const Key& path)
+		{
+			const std::string full_path = _resolver(path);
+
+			std::int64_t modified = 0;
+			std::uint64_t size = 0;
+			if (!stat_file(full_path, modified, size))
+			{
+				// gone already, the DELETED that follows says the rest
+				_fingerprints.erase(path);
+				return true;
+			}
+
+			const auto inserted = _fingerprints.try_emplace(path);
+			Fingerprint& fingerprint = inserted.first->second;
+			const bool known = !inserted.second;
+			if (known && fingerprint.modified == modified && fingerprint.size == size)
+				return false;
+
+			const bool resized = known && fingerprint.size != size;
+			fingerprint.modified = modified;
+			fingerprint.size = size;
+
+			if (resized || size > _max_size)
+			{
+				// the size alone tells it changed (or the file is too big to read), a later same size rewrite gets hashed
+				fingerprint.hashed = false;
+				return true;
+			}
+
+			std::uint64_t hash = 0;
+			if (!hash_file(full_path, hash, _scratch))
+			{
+				fingerprint.hashed = false;
+				return true;
+			}
+
+			const bool changed = !known || !fingerprint.hashed || fingerprint.hash != hash;
+			fingerprint.hash = hash;
+			fingerprint.hashed = true;
+			return changed;
+		}
+
+		Resolver _resolver;
+		Output _output;
+		const std::uint64_t _max_size;
+		const std::size_t _catch_up; // 0 to always verify
+
+		mutable std::mutex _mutex;
+		std::condition_variable _cv;
+		std::condition_variable _space; // the worker took what was pending, pushes waiting for room may go on
+		std::deque<Item> _pending;
+		std::size_t _capacity = 0;
+		QueuePolicy _policy = QueuePolicy::DROP_OLDEST;
+		DropCounts _counts;
+		bool _overloaded = false; // capacity was reached, the next batch goes out unverified
+		bool _stop = false;
+		std::thread _worker;
+
+		// only touched by the worker
+		std::unordered_map<Key, Fingerprint> _fingerprints;
+		std::vector<char> _scratch;
+		std::atomic<std::uint64_t> _suppressed{0};
+		std::atomic<std::uint64_t> _unverified{0};
+	};
+}
+#endif
@@ -0,0 +1,190 @@
+#ifndef COALESCER_H
+#define COALESCER_H
+
+#include <filewatch.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <algorithm>
+
+namespace filewatch {
+	// Folds the bursts editors and compilers produce for a single path into one event.
+	// A path is held back until nothing has happened to it for a whole quiet window, then released with the merged event.
+	// One that never goes quiet, a log written to all the time, is released anyway once it has been held for max_hold.
+	//
+	// Merge rules (pending event + new event -> pending event):
+	//   CREATED + CHANGED -> CREATED
+	//   CREATED + DELETED -> nothing, the path is forgotten
+	//   CHANGED + CHANGED -> CHANGED
+	//   CHANGED + DELETED -> DELETED
+	//   DELETED + CREATED -> CHANGED (atomic save through delete and re-create)
+	//   DELETED + CHANGED -> CHANGED
+	// Anything else (renames) never merges: whatever is pending for the path (and for the old path of a rename) is
+	// released first and the event follows it unchanged.
+	// Order is preserved per path, paths are released in the order they were first seen.
+	// Key is whatever identifies a path, a std::string or an interned PathId.
+	// A merged event is released with the time of the first event it was merged from, for latency measurements.
+	template <typename Key>
+	class Coalescer
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		explicit Coalescer(Clock::duration window = Clock::duration::zero(), Clock::duration max_hold = std::chrono::seconds(1)) :
+			_window(window),
+			_max_hold(max_hold)
+		{
+		}
+
+		Coalescer(const Coalescer&) = delete;
+		Coalescer& operator=(const Coalescer&) = delete;
+
+		void set_window(Clock::duration window)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_window = window;
+		}
+
+		Clock::duration window()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _window;
+		}
+
+		// never shorter than the window, a path is always held for that long
+		void set_max_hold(Clock::duration max_hold)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_max_hold = max_hold;
+		}
+
+		void push(const Key& path, const Event event_type, const Key& old_path = Key(), const Clock::time_point now = Clock::now())
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			if (!is_mergeable(event_type))
+			{
+				release(old_path);
+				release(path);
+				_released.push_back({ _sequence++, path, event_type, old_path, now });
+				return;
+			}
+
+			const std::uint64_t sequence = _sequence++;
+			auto found = _pending.find(path);
+			if (found == _pending.end())
+			{
+				_pending.emplace(path, Entry{ event_type, now, sequence, now });
+				return;
+			}
+
+			Entry& entry = found->second;
+			entry.last_seen = now;
+			switch (entry.event_type)
+			{
+				case Event::CREATED:
+					if (event_type == Event::DELETED)
+						_pending.erase(found);
+					break;
+				case Event::CHANGED:
+					if (event_type == Event::DELETED)
+						entry.event_type = Event::DELETED;
+					break;
+				case Event::DELETED:
+					if (event_type == Event::CREATED || event_type == Event::CHANGED)
+						entry.event_type = Event::CHANGED;
+					break;
+				default:
+					break;
+			}
+		}
+
+		// Hands every path that has been quiet for the whole window, or held for max_hold, to
+		// output(path, event_type, old_path, first_seen).
+		template <typename Output>
+		void drain(Output&& output, const Clock::time_point now = Clock::now())
+		{
+			std::vector<Released> ready;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				std::swap(ready, _released);
+
+				const Clock::duration max_hold = std::max(_max_hold, _window);
+				for (auto entry = _pending.begin(); entry != _pending.end();)
+				{
+					if (now - entry->second.last_seen >= _window || now - entry->second.first_seen >= max_hold)
+					{
+						ready.push_back({ entry->second.sequence, entry->first, entry->second.event_type, Key(), entry->second.first_seen });
+						entry = _pending.erase(entry);
+					}
+					else
+					{
+						++entry;
+					}
+				}
+			}
+
+			std::sort(ready.begin(), ready.end(), [](const Released& left, const Released& right) { return left.sequence < right.sequence; });
+			for (const Released& change : ready)
+				output(change.path, change.event_type, change.old_path, change.first_seen);
+		}
+
+		// Releases everything regardless of the window.
+		template <typename Output>
+		void flush(Output&& output)
+		{
+			drain(std::forward<Output>(output), Clock::time_point::max());
+		}
+
+		bool empty()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _pending.empty() && _released.empty();
+		}
+
+	private:
+		struct Entry
+		{
+			Event event_type;
+			Clock::time_point last_seen;
+			std::uint64_t sequence;
+			Clock::time_point first_seen;
+		};
+
+		struct Released
+		{
+			std::uint64_t sequence;
+			Key path;
+			Event event_type;
+			Key old_path;
+			Clock::time_point first_seen;
+		};
+
+		static bool is_mergeable(const Event event_type)
+		{
+			return event_type == Event::CREATED || event_type == Event::CHANGED || event_type == Event::DELETED;
+		}
+
+		// _mutex must be held
+		void release(const Key& path)
+		{
+			auto found = _pending.find(path);
+			if (found == _pending.end()) return;
+
+			_released.push_back({ found->second.sequence, found->first, found->second.event_type, Key(), found->second.first_seen });
+			_pending.erase(found);
+		}
+
+		std::mutex _mutex;
+		Clock::duration _window;
+		Clock::duration _max_hold;
+		std::uint64_t _sequence = 0;
+		std::unordered_map<Key, Entry> _pending;
+		std::vector<Released> _released;
+	};
+}
+#endif
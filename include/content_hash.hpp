@@ -0,0 +1,222 @@
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <unicode.hpp>
+
+namespace filewatch {
+	// Streaming XXH64 (https://github.com/Cyan4973/xxHash), seed 0.
+	// Not cryptographic, only meant to tell whether a file's bytes changed between two writes.
+	// The four lanes are independent of each other, which lets the compiler keep them all in flight at once.
+	class Hash64
+	{
+	public:
+		Hash64()
+		{
+			reset();
+		}
+
+		void reset()
+		{
+			_lanes[0] = _prime1 + _prime2;
+			_lanes[1] = _prime2;
+			_lanes[2] = 0;
+			_lanes[3] = 0 - _prime1;
+			_total = 0;
+			_buffered = 0;
+		}
+
+		void update(const void* data, std::size_t length)
+		{
+			const unsigned char* input = static_cast<const unsigned char*>(data);
+			_total += length;
+
+			if (_buffered + length < sizeof(_buffer))
+			{
+				std::memcpy(_buffer + _buffered, input, length);
+				_buffered += length;
+				return;
+			}
+
+			if (_buffered > 0)
+			{
+				const std::size_t fill = sizeof(_buffer) - _buffered;
+				std::memcpy(_buffer + _buffered, input, fill);
+				consume_stripe(_buffer);
+				input += fill;
+				length -= fill;
+				_buffered = 0;
+			}
+
+			while (length >= sizeof(_buffer))
+			{
+				consume_stripe(input);
+				input += sizeof(_buffer);
+				length -= sizeof(_buffer);
+			}
+
+			std::memcpy(_buffer, input, length);
+			_buffered = length;
+		}
+
+		std::uint64_t digest() const
+		{
+			std::uint64_t hash;
+			if (_total >= sizeof(_buffer))
+			{
+				hash = rotate(_lanes[0], 1) + rotate(_lanes[1], 7) + rotate(_lanes[2], 12) + rotate(_lanes[3], 18);
+				for (const std::uint64_t lane : _lanes)
+					hash = (hash ^ round(0, lane)) * _prime1 + _prime4;
+			}
+			else
+			{
+				hash = _prime5;
+			}
+
+			hash += _total;
+
+			const unsigned char* input = _buffer;
+			std::size_t length = _buffered;
+			while (length >= 8)
+			{
+				hash ^= round(0, read64(input));
+				hash = rotate(hash, 27) * _prime1 + _prime4;
+				input += 8;
+				length -= 8;
+			}
+
+			if (length >= 4)
+			{
+				hash ^= static_cast<std::uint64_t>(read32(input)) * _prime1;
+				hash = rotate(hash, 23) * _prime2 + _prime3;
+				input += 4;
+				length -= 4;
+			}
+
+			while (length > 0)
+			{
+				hash ^= (*input) * _prime5;
+				hash = rotate(hash, 11) * _prime1;
+				++input;
+				--length;
+			}
+
+			hash ^= hash >> 33;
+			hash *= _prime2;
+			hash ^= hash >> 29;
+			hash *= _prime3;
+			hash ^= hash >> 32;
+			return hash;
+		}
+
+		static std::uint64_t of(const void* data, const std::size_t length)
+		{
+			Hash64 hash;
+			hash.update(data, length);
+			return hash.digest();
+		}
+
+	private:
+		static constexpr std::uint64_t _prime1 = 0x9E3779B185EBCA87ULL;
+		static constexpr std::uint64_t _prime2 = 0xC2B2AE3D27D4EB4FULL;
+		static constexpr std::uint64_t _prime3 = 0x165667B19E3779F9ULL;
+		static constexpr std::uint64_t _prime4 = 0x85EBCA77C2B2AE63ULL;
+		static constexpr std::uint64_t _prime5 = 0x27D4EB2F165667C5ULL;
+
+		static std::uint64_t rotate(const std::uint64_t value, const int bits)
+		{
+			return (value << bits) | (value >> (64 - bits));
+		}
+
+		static std::uint64_t round(std::uint64_t accumulator, const std::uint64_t input)
+		{
+			accumulator += input * _prime2;
+			accumulator = rotate(accumulator, 31);
+			return accumulator * _prime1;
+		}
+
+		// little endian loads, memcpy keeps them alignment safe and compiles down to a plain load
+		static std::uint64_t read64(const unsigned char* input)
+		{
+			std::uint64_t value;
+			std::memcpy(&value, input, sizeof(value));
+			return value;
+		}
+
+		static std::uint32_t read32(const unsigned char* input)
+		{
+			std::uint32_t value;
+			std::memcpy(&value, input, sizeof(value));
+			return value;
+		}
+
+		void consume_stripe(const unsigned char* input)
+		{
+			_lanes[0] = round(_lanes[0], read64(input));
+			_lanes[1] = round(_lanes[1], read64(input + 8));
+			_lanes[2] = round(_lanes[2], read64(input + 16));
+			_lanes[3] = round(_lanes[3], read64(input + 24));
+		}
+
+		std::uint64_t _lanes[4];
+		std::uint64_t _total;
+		unsigned char _buffer[32];
+		std::size_t _buffered;
+	};
+
+	// Modification time (nanoseconds on Linux, 100 ns ticks on Windows) and size of a file, false when it can't be
+	// stat'ed. Whole seconds would let two writes of the same size within one second look like no change at all.
+	inline bool stat_file(const std::string& path, std::int64_t& modified, std::uint64_t& size)
+	{
+#ifdef _WIN32
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if (!GetFileAttributesExW(widen(path).c_str(), GetFileExInfoStandard, &data)) return false;
+		modified = static_cast<std::int64_t>((static_cast<std::uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime);
+		size = (static_cast<std::uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+#else
+		struct stat statbuf = {};
+		if (stat(path.c_str(), &statbuf) != 0) return false;
+		modified = static_cast<std::int64_t>(statbuf.st_mtim.tv_sec) * 1000000000 + statbuf.st_mtim.tv_nsec;
+		size = static_cast<std::uint64_t>(statbuf.st_size);
+#endif // _WIN32
+		return true;
+	}
+
+	// Opens a file for reading in binary by its UTF-8 path, nullptr when it can't be
+	inline FILE* open_file(const std::string& path)
+	{
+#ifdef _WIN32
+		return _wfopen(widen(path).c_str(), L"rb");
+#else
+		return std::fopen(path.c_str(), "rb");
+#endif // _WIN32
+	}
+
+	// Hashes a whole file in fixed size chunks. Returns false when it can't be opened or read.
+	inline bool hash_file(const std::string& path, std::uint64_t& hash, std::vector<char>& scratch)
+	{
+		FILE* file = open_file(path);
+		if (file == nullptr) return false;
+
+		scratch.resize(64 * 1024);
+		Hash64 state;
+		std::size_t read = 0;
+		while ((read = std::fread(scratch.data(), 1, scratch.size(), file)) > 0)
+			state.update(scratch.data(), read);
+
+		const bool failed = std::ferror(file) != 0;
+		std::fclose(file);
+		if (failed) return false;
+
+		hash = state.digest();
+		return true;
+	}
+}
+#endif
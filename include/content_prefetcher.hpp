@@ -0,0 +1,215 @@
+#ifndef CONTENT_PREFETCHER_H
+#define CONTENT_PREFETCHER_H
+
+#include <filewatch.hpp>
+#include <content_hash.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace filewatch {
+	// Reads changed files on a pool of worker threads, so whoever handles the change gets the bytes along with it
+	// instead of going to the disk itself. A request is done once its contents are in, or once it is known they won't
+	// be: the file is gone, larger than max_size or can't be read.
+	//
+	// What was read stays cached for cache_for. A request is answered from it when the read started after the change
+	// it is for was seen, and the file's modification time and size are still the same: a CREATED and the CHANGED right
+	// behind it share a read, a file that changes again gets read again.
+	template <typename Key>
+	class ContentPrefetcher
+	{
+	public:
+		using Resolver = std::function<std::string(const Key& path)>; // full path on disk of a key
+		using Contents = std::shared_ptr<const std::string>;
+
+		struct Request
+		{
+			Key path;
+			Clock::time_point since; // the change it is for was seen by then
+			Contents contents; // only read once done is set, nullptr when there is nothing to hand out
+			std::atomic_bool done{false};
+		};
+
+		ContentPrefetcher(Resolver resolver, const std::size_t workers, const std::uint64_t max_size, const Clock::duration cache_for) :
+			_resolver(std::move(resolver)),
+			_max_size(max_size),
+			_cache_for(cache_for)
+		{
+			for (std::size_t worker = 0; worker < std::max<std::size_t>(workers, 1); ++worker)
+				_workers.emplace_back([this]() { work(); });
+		}
+
+		// requests still queued are marked done without contents, whoever waits on them is never left hanging
+		~ContentPrefetcher()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stop = true;
+			}
+			_cv.notify_all();
+			for (std::thread& worker : _workers)
+				worker.join();
+
+			for (const std::shared_ptr<Request>& request : _pending)
+				request->done.store(true, std::memory_order_release);
+		}
+
+		ContentPrefetcher(const ContentPrefetcher&) = delete;
+		ContentPrefetcher& operator=(const ContentPrefetcher&) = delete;
+
+		std::shared_ptr<Request> request(const Key& path, const Clock::time_point since)
+		{
+			auto request = std::make_shared<Request>();
+			request->path = path;
+			request->since = since;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_pending.push_back(request);
+			}
+			_cv.notify_one();
+			return request;
+		}
+
+		// drops what is cached for path, for files that are gone
+		void forget(const Key& path)
+		{
+			std::lock_guard<std::mutex> lock(_cache_mutex);
+			_cache.erase(path);
+		}
+
+		// files read from disk so far, and requests answered from the cache
+		std::uint64_t reads() const
+		{
+			return _reads;
+		}
+
+		std::uint64_t hits() const
+		{
+			return _hits;
+		}
+
+	private:
+		struct Cached
+		{
+			std::int64_t modified;
+			std::uint64_t size;
+			Contents contents;
+			Clock::time_point read; // when reading started
+		};
+
+		void work()
+		{
+			while (true)
+			{
+				std::shared_ptr<Request> request;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_cv.wait(lock, [this] { return _stop || !_pending.empty(); });
+					if (_stop) return;
+
+					request = std::move(_pending.front());
+					_pending.pop_front();
+				}
+
+				request->contents = load(*request);
+				request->done.store(true, std::memory_order_release);
+			}
+		}
+
+		Contents load(const Request& request)
+		{
+			const std::string full_path = _resolver(request.path);
+			std::int64_t modified = 0;
+			std::uint64_t size = 0;
+			if (!stat_file(full_path, modified, size) || size > _max_size) return nullptr;
+
+			const Clock::time_point now = Clock::now();
+			{
+				std::lock_guard<std::mutex> lock(_cache_mutex);
+				expire(now);
+				const auto found = _cache.find(request.path);
+				if (found != _cache.end() && found->second.read >= request.since && found->second.modified == modified && found->second.size == size)
+				{
+					++_hits;
+					return found->second.contents;
+				}
+			}
+
+			auto contents = std::make_shared<std::string>();
+			if (!read_file(full_path, size, *contents)) return nullptr;
+			++_reads;
+
+			std::lock_guard<std::mutex> lock(_cache_mutex);
+			_cache[request.path] = Cached{ modified, size, contents, now };
+			_expiry.emplace_back(request.path, now);
+			return contents;
+		}
+
+		// size is what stat said, the file may have grown or shrunk since and is read until its end regardless,
+		// as long as it stays within max_size
+		bool read_file(const std::string& path, const std::uint64_t size, std::string& contents) const
+		{
+			FILE* file = open_file(path);
+			if (file == nullptr) return false;
+
+			contents.resize(static_cast<std::size_t>(std::min(size, _max_size)) + 1);
+			std::size_t total = 0;
+			std::size_t read = 0;
+			while ((read = std::fread(&contents[total], 1, contents.size() - total, file)) > 0)
+			{
+				total += read;
+				if (total == contents.size())
+				{
+					if (total > _max_size) break;
+					contents.resize(std::min<std::uint64_t>(contents.size() * 2, _max_size + 1));
+				}
+			}
+
+			const bool failed = std::ferror(file) != 0 || total > _max_size;
+			std::fclose(file);
+			contents.resize(total);
+			return !failed;
+		}
+
+		// expects _cache_mutex held; entries go in the order they were read, so only the front ever needs looking at
+		void expire(const Clock::time_point now)
+		{
+			while (!_expiry.empty() && now - _expiry.front().second >= _cache_for)
+			{
+				const auto found = _cache.find(_expiry.front().first);
+				if (found != _cache.end() && found->second.read == _expiry.front().second)
+					_cache.erase(found);
+				_expiry.pop_front();
+			}
+		}
+
+		const Resolver _resolver;
+		const std::uint64_t _max_size;
+		const Clock::duration _cache_for;
+
+		std::mutex _mutex;
+		std::condition_variable _cv;
+		std::deque<std::shared_ptr<Request>> _pending;
+		bool _stop = false;
+		std::vector<std::thread> _workers;
+
+		std::mutex _cache_mutex;
+		std::unordered_map<Key, Cached> _cache;
+		std::deque<std::pair<Key, Clock::time_point>> _expiry; // every read, oldest first, stale ones are skipped
+		std::atomic<std::uint64_t> _reads{0};
+		std::atomic<std::uint64_t> _hits{0};
+	};
+}
+#endif
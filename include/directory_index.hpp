@@ -0,0 +1,194 @@
+#ifndef DIRECTORY_INDEX_H
+#define DIRECTORY_INDEX_H
+
+#include <change_journal.hpp>
+#include <path_filter.hpp>
+
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace filewatch {
+	// Every entry under a root, answering lookups and globs from memory. Each directory keeps its children in a flat
+	// array sorted by name, so listing one is a single contiguous scan and a lookup a binary search in it.
+	// One thread writes (the watch thread, from the event stream), any number read.
+	class DirectoryIndex
+	{
+	public:
+		using State = std::unordered_map<std::string, EntryState>;
+
+		// replaces everything with state, keyed by path relative to the root
+		void assign(const State& state)
+		{
+			std::unique_lock<std::shared_mutex> lock(_mutex);
+			_directories.clear();
+			_directories[std::string()];
+			for (const auto& entry : state)
+				insert(entry.first, entry.second);
+			for (auto& directory : _directories)
+				std::sort(directory.second.begin(), directory.second.end(), [](const Entry& left, const Entry& right) { return left.name < right.name; });
+		}
+
+		void set(const std::string_view path, const EntryState& state)
+		{
+			std::unique_lock<std::shared_mutex> lock(_mutex);
+			std::vector<Entry>& children = _directories[std::string(PathFilter::directory_name(path))];
+			const std::string_view name = PathFilter::file_name(path);
+			const auto found = find_child(children, name);
+			if (found != children.end() && found->name == name)
+				found->state = state;
+			else
+				children.insert(found, Entry{ std::string(name), state });
+
+			if (state.directory)
+				_directories[std::string(path)];
+		}
+
+		// removes path, along with everything below it
+		void erase(const std::string_view path)
+		{
+			std::unique_lock<std::shared_mutex> lock(_mutex);
+			const auto directory = _directories.find(std::string(PathFilter::directory_name(path)));
+			if (directory == _directories.end()) return;
+
+			std::vector<Entry>& children = directory->second;
+			const std::string_view name = PathFilter::file_name(path);
+			const auto found = find_child(children, name);
+			if (found == children.end() || found->name != name) return;
+
+			const bool is_directory = found->state.directory;
+			children.erase(found);
+			if (is_directory)
+				erase_tree(std::string(path));
+		}
+
+		bool stat(const std::string_view path, EntryState& state) const
+		{
+			std::shared_lock<std::shared_mutex> lock(_mutex);
+			const auto directory = _directories.find(std::string(PathFilter::directory_name(path)));
+			if (directory == _directories.end()) return false;
+
+			const std::string_view name = PathFilter::file_name(path);
+			const auto found = find_child(directory->second, name);
+			if (found == directory->second.end() || found->name != name) return false;
+
+			state = found->state;
+			return true;
+		}
+
+		// Hands output(path, state) every entry whose path matches pattern (see PathFilter::glob_match, a pattern
+		// without a '/' only looks at the top of the root), in order within each directory. Only what is below the
+		// pattern's leading literal directories is visited, and only that one directory unless the rest crosses into
+		// others: "lua/autorun/*.lua" reads a single array. The matches are copied out first and output is called
+		// without the lock held, so a slow consumer (Lua building tables) never holds up set() and erase() on the watch thread.
+		template <typename Output>
+		void find(std::string_view pattern, Output&& output) const
+		{
+			while (!pattern.empty() && PathFilter::is_separator(pattern.front()))
+				pattern.remove_prefix(1);
+
+			// the components up to the first wildcard name the one directory everything matching is under
+			std::size_t literal = 0;
+			for (std::size_t i = 0; i < pattern.size() && pattern[i] != '*' && pattern[i] != '?'; ++i)
+			{
+				if (PathFilter::is_separator(pattern[i]))
+					literal = i + 1;
+			}
+			const std::string start(pattern.substr(0, literal == 0 ? 0 : literal - 1));
+			const std::string_view rest = pattern.substr(literal);
+			const bool deep = rest.find("**") != std::string_view::npos || rest.find_first_of("/\\") != std::string_view::npos;
+
+			std::vector<std::pair<std::string, EntryState>> matches;
+			{
+				std::shared_lock<std::shared_mutex> lock(_mutex);
+				std::string path;
+				visit(start, pattern, deep, path, matches);
+			}
+
+			for (const auto& match : matches)
+				output(std::string_view(match.first), match.second);
+		}
+
+		std::size_t directories() const
+		{
+			std::shared_lock<std::shared_mutex> lock(_mutex);
+			return _directories.size();
+		}
+
+		void clear()
+		{
+			std::unique_lock<std::shared_mutex> lock(_mutex);
+			_directories.clear();
+		}
+
+	private:
+		struct Entry
+		{
+			std::string name;
+			EntryState state;
+		};
+
+		// where name is, or would go, among children
+		static std::vector<Entry>::iterator find_child(std::vector<Entry>& children, const std::string_view name)
+		{
+			return std::lower_bound(children.begin(), children.end(), name, [](const Entry& entry, const std::string_view key) { return entry.name < key; });
+		}
+
+		static std::vector<Entry>::const_iterator find_child(const std::vector<Entry>& children, const std::string_view name)
+		{
+			return std::lower_bound(children.begin(), children.end(), name, [](const Entry& entry, const std::string_view key) { return entry.name < key; });
+		}
+
+		// appends without sorting, assign() sorts once everything is in
+		void insert(const std::string_view path, const EntryState& state)
+		{
+			_directories[std::string(PathFilter::directory_name(path))].push_back(Entry{ std::string(PathFilter::file_name(path)), state });
+			if (state.directory)
+				_directories[std::string(path)];
+		}
+
+		void erase_tree(const std::string& directory)
+		{
+			const auto found = _directories.find(directory);
+			if (found == _directories.end()) return;
+
+			const std::vector<Entry> children = std::move(found->second);
+			_directories.erase(found);
+			for (const Entry& child : children)
+			{
+				if (child.state.directory)
+					erase_tree(directory + "/" + child.name);
+			}
+		}
+
+		// path is scratch, the entry's path is built in it as the walk goes down; _mutex must be held
+		void visit(const std::string& directory, const std::string_view pattern, const bool deep, std::string& path,
+			std::vector<std::pair<std::string, EntryState>>& matches) const
+		{
+			const auto found = _directories.find(directory);
+			if (found == _directories.end()) return;
+
+			for (const Entry& child : found->second)
+			{
+				path.assign(directory);
+				if (!path.empty())
+					path.push_back('/');
+				path.append(child.name);
+
+				if (PathFilter::glob_match(pattern, path))
+					matches.emplace_back(path, child.state);
+				if (deep && child.state.directory)
+					visit(directory.empty() ? child.name : directory + "/" + child.name, pattern, deep, path, matches);
+			}
+		}
+
+		mutable std::shared_mutex _mutex;
+		std::unordered_map<std::string, std::vector<Entry>> _directories; // directory ("" for the root) -> its children by name
+	};
+}
+#endif
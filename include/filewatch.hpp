@@ -7,10 +7,10 @@
 #include <windows.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <iostream>
 #include <tchar.h>
 #include <Pathcch.h>
 #include <shlwapi.h>
+#include <cwchar>
 #endif // WIN32
 
 #if __unix__
@@ -21,6 +21,19 @@
 #include <sys/inotify.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/statfs.h>
+#if __has_include(<sys/fanotify.h>)
+#include <sys/fanotify.h>
+#endif
+
+// FAN_REPORT_DFID_NAME landed with Linux 5.9, older headers only get the inotify backend
+#ifdef FAN_REPORT_DFID_NAME
+#define FILEWATCH_FANOTIFY 1
+#endif
 #endif // __unix__
 
 #include <functional>
@@ -32,438 +45,2745 @@
 #include <vector>
 #include <array>
 #include <map>
+#include <set>
 #include <system_error>
 #include <string>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <future>
+#include <memory>
+#include <string_view>
+#include <stdexcept>
+#include <cctype>
+#include <chrono>
+#include <iterator>
+#include <type_traits>
+
+#include <path_filter.hpp>
+#include <parallel_walker.hpp>
+#include <change_journal.hpp>
+#include <directory_index.hpp>
+#include <unicode.hpp>
 
 namespace filewatch {
 	enum class Event {
 		CREATED,
 		DELETED,
 		CHANGED,
-		RENAMED_OLD,
-		RENAMED_NEW
+		RENAMED_OLD,   // one half of a rename that could not be paired up, the path is the old name
+		RENAMED_NEW,   // one half of a rename that could not be paired up, the path is the new name
+		RENAMED,       // path is the new name, old_path the name it had before
+		QUEUE_OVERFLOW, // the OS dropped events, comes with an empty path ahead of the events recovered by the resync
+		DIRTY,          // path is a directory some of whose events were collapsed into this one by a full queue
+		READY           // the initial walk of the root is done and every directory under it is covered, comes with an empty path
 	};
 
-	class FileWatch
+	// the name of every event type, indexed by its value
+	inline constexpr const char* event_names[] = {
+		"CREATED", "DELETED", "CHANGED", "RENAMED_OLD", "RENAMED_NEW", "RENAMED", "OVERFLOW", "DIRTY", "READY"
+	};
+	static_assert(std::size(event_names) == static_cast<std::size_t>(Event::READY) + 1, "every event type needs a name");
+
+	constexpr const char* event_name(const Event type)
+	{
+		return static_cast<std::size_t>(type) < std::size(event_names) ? event_names[static_cast<std::size_t>(type)] : "UNKNOWN";
+	}
+
+	using RootId = std::uint32_t;
+	using Clock = std::chrono::steady_clock;
+
+	struct FileEvent
+	{
+		std::string_view path; // relative to the watched directory, only valid for the duration of the callback
+		Event type;
+		std::string_view old_path = std::string_view(); // the previous path of a RENAMED entry
+		RootId root = 0; // the watched directory path is relative to, see FileWatch::add_root()
+		Clock::time_point captured = Clock::time_point(); // when the read reporting it returned, for latency measurements
+	};
+
+	// Events packed back to back into one text buffer. Batches are cleared and swapped rather than
+	// reallocated, so collecting and handing over events stops allocating once the buffers have grown.
+	class EventBatch
+	{
+	public:
+		// An entry is built with begin()/append() and then either kept with commit() or thrown away with rollback().
+		// A rename appends the old path, calls split() and appends the new path; commit_old()/commit_new() keep
+		// only one side of it as a plain event.
+		void begin()
+		{
+			_start = _text.size();
+			_split = npos;
+		}
+
+		// every entry committed from here on belongs to root
+		void set_root(const RootId root)
+		{
+			_root = root;
+		}
+
+		// every entry committed from here on was captured at time
+		void set_captured(const Clock::time_point time)
+		{
+			_captured = time;
+		}
+
+		void split()
+		{
+			_split = _text.size();
+		}
+
+		void append(const std::string_view part)
+		{
+			_text.append(part.data(), part.size());
+		}
+
+		void append(const char character)
+		{
+			_text.push_back(character);
+		}
+
+		// UTF-16 as the OS reports it, appended as UTF-8 with '\' turned into '/'
+		template <typename Unit>
+		void append_utf16(const Unit* text, const std::size_t length)
+		{
+			append_utf8(text, length, _text, true);
+		}
+
+		// the path appended since begin(), or since split() for a rename
+		std::string_view pending() const
+		{
+			return std::string_view(_text).substr(_split == npos ? _start : _split);
+		}
+
+		// the old path of a rename being built
+		std::string_view pending_old() const
+		{
+			return _split == npos ? std::string_view() : std::string_view(_text).substr(_start, _split - _start);
+		}
+
+		void commit(const Event type)
+		{
+			if (_split == npos)
+				_records.push_back({ _start, _text.size() - _start, type, 0, 0, _root, _captured });
+			else
+				_records.push_back({ _split, _text.size() - _split, type, _start, _split - _start, _root, _captured });
+		}
+
+		void commit_old(const Event type)
+		{
+			_records.push_back({ _start, _split - _start, type, 0, 0, _root, _captured });
+		}
+
+		void commit_new(const Event type)
+		{
+			_records.push_back({ _split, _text.size() - _split, type, 0, 0, _root, _captured });
+		}
+
+		void rollback()
+		{
+			_text.resize(_start);
+		}
+
+		// keeps the first count entries, the text of the others stays until clear()
+		void truncate(const std::size_t count)
+		{
+			if (count < _records.size())
+				_records.resize(count);
+		}
+
+		// drops the first count entries along with their text, not for a batch with an entry being built
+		void drop_front(const std::size_t count)
+		{
+			if (count >= _records.size())
+			{
+				_text.clear();
+				_records.clear();
+				_start = 0;
+				return;
+			}
+
+			// entries are committed in text order, nothing past this point belongs to the dropped ones
+			const Record& first = _records[count];
+			const std::size_t cut = first.old_length > 0 ? std::min(first.offset, first.old_offset) : first.offset;
+			_text.erase(0, cut);
+			_records.erase(_records.begin(), _records.begin() + static_cast<std::ptrdiff_t>(count));
+			for (Record& record : _records)
+			{
+				record.offset -= cut;
+				if (record.old_length > 0)
+					record.old_offset -= cut;
+			}
+			_start = _text.size();
+		}
+
+		void emplace_back(const std::string_view path, const Event type)
+		{
+			begin();
+			append(path);
+			commit(type);
+		}
+
+		void append(const EventBatch& other)
+		{
+			const std::size_t offset = _text.size();
+			_text.append(other._text);
+			for (const Record& record : other._records)
+				_records.push_back({ record.offset + offset, record.length, record.type, record.old_offset + offset, record.old_length, record.root, record.captured });
+		}
+
+		template <typename Callback>
+		void for_each(Callback&& callback) const
+		{
+			const std::string_view text(_text);
+			for (const Record& record : _records)
+				callback(FileEvent{ text.substr(record.offset, record.length), record.type, text.substr(record.old_offset, record.old_length), record.root, record.captured });
+		}
+
+		bool empty() const
+		{
+			return _records.empty();
+		}
+
+		std::size_t size() const
+		{
+			return _records.size();
+		}
+
+		void clear()
+		{
+			_text.clear();
+			_records.clear();
+			_start = 0;
+			_split = npos;
+			_root = 0;
+		}
+
+		void swap(EventBatch& other)
+		{
+			_text.swap(other._text);
+			_records.swap(other._records);
+			std::swap(_start, other._start);
+			std::swap(_split, other._split);
+			std::swap(_root, other._root);
+			std::swap(_captured, other._captured);
+		}
+
+	private:
+		static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+		struct Record
+		{
+			std::size_t offset;
+			std::size_t length;
+			Event type;
+			std::size_t old_offset;
+			std::size_t old_length;
+			RootId root;
+			Clock::time_point captured;
+		};
+
+		std::string _text;
+		std::vector<Record> _records;
+		std::size_t _start = 0;
+		std::size_t _split = npos;
+		RootId _root = 0;
+		Clock::time_point _captured = Clock::time_point();
+	};
+
+	// Where the callback runs.
+	// THREADED hands events over to a dedicated callback thread, so a slow callback never holds up reading.
+	// DIRECT calls the callback on the watch thread as soon as a read is parsed, saving a thread and a wake-up per batch;
+	// the callback then has to be quick and thread safe on its own, e.g. push into a queue and return.
+	enum class Delivery {
+		THREADED,
+		DIRECT
+	};
+
+	// What a full queue does with more events, see Options::queue_capacity.
+	// BLOCK makes the producer wait for room; for the watch thread that moves the backlog into the kernel queue,
+	// whose overflow the resync recovers from. COLLAPSE keeps a single DIRTY event per directory for whatever did not fit.
+	enum class QueuePolicy {
+		BLOCK,
+		DROP_NEWEST,
+		DROP_OLDEST,
+		COLLAPSE
+	};
+
+	// What a bounded queue had to give up so far.
+	struct DropCounts
+	{
+		std::uint64_t dropped = 0;   // events lost for good
+		std::uint64_t collapsed = 0; // events folded into a DIRTY event
+		std::uint64_t blocked = 0;   // times a producer had to wait for room
+	};
+
+	// The kernel facility used to watch with.
+	// NATIVE is inotify on Linux, one watch per directory, and ReadDirectoryChangesW on Windows.
+	// FANOTIFY (Linux 5.9 and up, needs CAP_SYS_ADMIN) puts a single mark on each filesystem a root lives on and
+	// resolves paths from the directory handles the kernel reports, so the cost no longer grows with the number of
+	// directories. Whenever it can't be used the watch falls back to NATIVE, FileWatch::backend() tells which one it got.
+	enum class Backend {
+		NATIVE,
+		FANOTIFY
+	};
+
+	struct Options
+	{
+		Delivery delivery = Delivery::THREADED;
+		Backend backend = Backend::NATIVE;
+
+		// Keep a snapshot of the tree (modification time, size and inode of every entry) so that events lost to a queue
+		// overflow can be recovered by diffing it against the disk. Costs a stat per entry at startup and one per event.
+		bool resync = true;
+
+		// Events waiting for the callback thread at most, 0 for no limit. Unused with DIRECT delivery, which queues nothing.
+		std::size_t queue_capacity = 0;
+		QueuePolicy queue_policy = QueuePolicy::DROP_OLDEST;
+
+		// Threads that walk a new root to arm and snapshot it, 0 picks one per core up to 8.
+		// Events are reported for every directory as soon as it is armed, Event::READY once all of them are.
+		std::size_t walk_threads = 0;
+
+		// File the snapshot of the first root is kept in across runs, see FileWatch::changes_since_last_run(). Written as
+		// events come in, the entries changed since the last run are told once the root is READY. Needs resync.
+		std::string journal{};
+
+		// Keep a DirectoryIndex of every root for FileWatch::find() and FileWatch::lookup(), filled from the snapshot once
+		// the root is READY and kept up to date by the events from then on. Needs resync.
+		bool index = false;
+
+		// Told about every problem the watch works around on its own: a backend falling back, the inotify watch limit,
+		// a journal that can't be kept. Called from whichever thread ran into it, nothing is said when left empty.
+		std::function<void(const std::string& message)> on_error{};
+	};
+
+	// what changed under the first root while nothing was watching it
+	struct ChangesSinceLastRun
+	{
+		bool fresh = false; // there was no journal to compare against, everything on disk is CREATED and deletions are unknown
+		std::vector<std::pair<std::string, Event>> changes;
+	};
+
+	// Watches any number of directories (or single files), each one a root with its own id.
+	// All roots share one OS handle (one inotify or fanotify instance on Linux, one completion port on Windows),
+	// one watch thread and one callback thread, adding a root costs a directory walk and nothing more.
+	//
+	// Sink is what every event is handed to, anything callable with a const FileEvent&. FileWatch takes any callable
+	// through a std::function; a concrete type lets the call inline into the loop delivering a batch.
+	template <typename Sink = std::function<void(const FileEvent& event)>>
+	class BasicFileWatch
 	{
 	public:
+		using Callback = Sink;
+
+		// path becomes root 0
+		BasicFileWatch(std::string path, Callback callback, Options options = Options()) :
+			_options(options),
+			_callback(std::move(callback))
+		{
+			open();
+			try
+			{
+				add_first_root(path);
+			}
+			catch (...)
+			{
+				release();
+				throw;
+			}
+			init();
+		}
+
+		BasicFileWatch(std::string path, Callback callback, Delivery delivery) : BasicFileWatch(std::move(path), std::move(callback), Options{ delivery }) {}
+
+		~BasicFileWatch()
+		{
+			destroy();
+		}
+
+		BasicFileWatch(const BasicFileWatch& other) :
+			_options(other._options),
+			_callback(other._callback)
+		{
+			_options.journal.clear(); // the journal has one writer, the original
+			open();
+			try
+			{
+				copy_roots(other);
+			}
+			catch (...)
+			{
+				release();
+				throw;
+			}
+			init();
+		}
+
+		BasicFileWatch& operator=(const BasicFileWatch& other)
+		{
+			if (this == &other) return *this;
+
+			destroy();
+			_options = other._options;
+			_options.journal.clear();
+			_callback = other._callback;
+			open();
+			copy_roots(other);
+			init();
+			return *this;
+		}
+
+		// Const member variables don't let me implent moves nicely, if moves are really wanted std::unique_ptr should be used and move that.
+		BasicFileWatch(BasicFileWatch&&) = delete;
+		BasicFileWatch& operator=(BasicFileWatch&&) & = delete;
+
+		// Drops every event for path under root id for the next window, for changes the process is about to make itself
+		// and has no use hearing back about. Checked on the watch thread after the snapshot took the change in, so
+		// everything but the callback still sees it. Calling it again for the same path starts the window over.
+		void ignore_next(const RootId id, const std::string_view path, const Clock::duration window = std::chrono::seconds(1))
+		{
+			std::string key;
+			ignore_key(path, key);
+
+			std::lock_guard<std::mutex> lock(_ignore_mutex);
+			const Clock::time_point now = Clock::now();
+			if (_ignored.size() >= 64)
+			{
+				// only grows past a handful with paths written once and never again, sweep them out now and then
+				for (auto root = _ignored.begin(); root != _ignored.end(); )
+				{
+					for (auto entry = root->second.begin(); entry != root->second.end(); )
+						entry = entry->second <= now ? root->second.erase(entry) : std::next(entry);
+					root = root->second.empty() ? _ignored.erase(root) : std::next(root);
+				}
+			}
+
+			_ignored[id][std::move(key)] = now + window;
+			_ignoring = _ignored.size();
+		}
+
+		// events ignore_next() dropped so far
+		std::uint64_t ignored() const
+		{
+			return _ignored_events;
+		}
+
+		// Replaces the path filter, events it rejects are dropped on the watch thread before they are queued.
+		// Passing nullptr lets everything through again. Applies to every root.
+		void set_filter(std::shared_ptr<const PathFilter> filter)
+		{
+			std::lock_guard<std::mutex> lock(_filter_mutex);
+			_pending_filter = std::move(filter);
+			_filter_changed = true;
+		}
+
+		// Starts watching another directory or file, events under it carry the returned id as FileEvent::root.
+		// filter, when set, only applies to this root and on top of the one given to set_filter().
+		// Throws std::system_error when path can't be watched and std::invalid_argument when it is inside, or contains,
+		// a directory that is already watched. Events start flowing once the watch thread armed it, shortly after.
+		RootId add_root(const std::string& path, std::shared_ptr<const PathFilter> filter = nullptr)
+		{
+			std::lock_guard<std::mutex> lock(_command_mutex);
+			return open_root(_next_root, path, std::move(filter));
+		}
+
+		// Stops watching a root, returns false if there is no root with that id.
+		// Events of it that were already queued may still reach the callback.
+		bool remove_root(const RootId id)
+		{
+			std::lock_guard<std::mutex> lock(_command_mutex);
+			if (_root_info.erase(id) == 0) return false;
+
+			_commands.push_back(Command{ nullptr, id });
+			_commands_pending = true;
+			wake();
+			return true;
+		}
+
+		Backend backend() const
+		{
+			return _options.backend;
+		}
+
+		// what the callback queue gave up so far to stay within Options::queue_capacity
+		DropCounts drop_counts() const
+		{
+			std::lock_guard<std::mutex> lock(_callback_mutex);
+			return _drop_counts;
+		}
+
+		// whether the walk of a root is done, see Event::READY; false if there is no root with that id
+		bool ready(const RootId id) const
+		{
+			std::lock_guard<std::mutex> lock(_command_mutex);
+			const auto found = _root_info.find(id);
+			return found != _root_info.end() && found->second.ready;
+		}
+
+		// Hands out what changed under the first root since the journal was last written, see Options::journal.
+		// False until the root is READY and when there is no journal.
+		bool changes_since_last_run(ChangesSinceLastRun& changes) const
+		{
+			std::lock_guard<std::mutex> lock(_command_mutex);
+			if (!_since_last_run_known) return false;
+
+			changes = _since_last_run;
+			return true;
+		}
+
+		// Hands output(path, state) every entry under root id matching pattern, see DirectoryIndex::find().
+		// False when the root isn't READY yet, doesn't exist or Options::index is off.
+		template <typename Output>
+		bool find(const RootId id, const std::string_view pattern, Output&& output) const
+		{
+			const std::shared_ptr<const DirectoryIndex> index = find_index(id);
+			if (!index) return false;
+
+			index->find(pattern, output);
+			return true;
+		}
+
+		// the last known state of path under root id, false when it isn't known or there is no index, see find()
+		bool lookup(const RootId id, const std::string_view path, EntryState& state) const
+		{
+			const std::shared_ptr<const DirectoryIndex> index = find_index(id);
+			return index && index->stat(path, state);
+		}
+
+		// the directory paths of a root are relative to, empty if there is no root with that id
+		std::string root_directory(const RootId id) const
+		{
+			std::lock_guard<std::mutex> lock(_command_mutex);
+			const auto found = _root_info.find(id);
+			return found == _root_info.end() ? std::string() : found->second.directory;
+		}
+
+	private:
+		struct PathParts
+		{
+			PathParts(std::string _directory, std::string _filename) : directory(_directory), filename(_filename) {}
+			std::string directory;
+			std::string filename;
+		};
+
+		static constexpr std::size_t _buffer_size = 1024 * 256;
+
+		std::shared_ptr<const DirectoryIndex> find_index(const RootId id) const
+		{
+			std::lock_guard<std::mutex> lock(_command_mutex);
+			const auto found = _root_info.find(id);
+			return found == _root_info.end() ? nullptr : found->second.index;
+		}
+
+		std::atomic_bool _destroy{false};
+
+		Options _options;
+		Callback _callback;
+
+		std::thread _watch_thread;
+
+		std::condition_variable _cv;
+		mutable std::mutex _callback_mutex;
+		EventBatch _callback_information;
+		std::thread _callback_thread;
+
+		// a bounded callback queue: the watch thread waits on _space_cv under BLOCK, COLLAPSE leaves the directories
+		// of what did not fit in _dirty, handed out as DIRTY events along with the next batch
+		std::condition_variable _space_cv;
+		std::set<std::pair<RootId, std::string>> _dirty;
+		DropCounts _drop_counts;
+
+		std::promise<void> _running;
+
+		// the watch thread only picks up a new filter when _filter_changed is set, so the common path stays lock free
+		std::mutex _filter_mutex;
+		std::shared_ptr<const PathFilter> _pending_filter;
+		std::atomic_bool _filter_changed{false};
+		std::shared_ptr<const PathFilter> _filter;
+
+		// ignore_next() paths, by root, to when they stop being ignored; _ignoring tells the watch thread whether to
+		// look at all without taking the lock
+		std::mutex _ignore_mutex;
+		std::unordered_map<RootId, std::unordered_map<std::string, Clock::time_point>> _ignored;
+		std::atomic<std::size_t> _ignoring{0};
+		std::atomic<std::uint64_t> _ignored_events{0};
+		std::string _ignore_path; // scratch key, watch thread only
+
+		// last known state of every entry under a root, keyed by relative path
+		using Snapshot = std::unordered_map<std::string, EntryState>;
+		std::string _state_path; // scratch key, so looking up a snapshot does not allocate
+
+		// a root being walked in the background, each worker fills its own snapshot, merged in once it's done
+		struct Walk
+		{
+			std::vector<Snapshot> snapshots;
+			std::unordered_set<std::string> touched; // paths events put into or took out of the snapshot meanwhile
+			std::vector<std::string> moved;          // directories that moved or went away meanwhile, with a trailing '/'
+			std::atomic_bool done{false};
+			std::unique_ptr<ParallelWalker> walker; // last, so it is joined before what it writes into goes away
+		};
+		std::atomic_bool _walks_done{false}; // some walk set its done, picked up by collect_walks()
+
+		// Options::journal, opened from the watch thread once the first root is ready and only touched by it from then on;
+		// _since_last_run is read under _command_mutex
+		std::unique_ptr<ChangeJournal> _journal;
+		bool _journal_opened = false;
+		std::string _journal_entry; // the journal's own path relative to the first root, its writes are nobody's business
+		ChangesSinceLastRun _since_last_run;
+		bool _since_last_run_known = false;
+
+		// one watched directory, only touched by the watch thread once it has been handed over
+		struct Root
+		{
+			RootId id = 0;
+			std::string watch_root; // the directory actually being watched
+			std::string canonical;  // absolute form of watch_root with a trailing '/', to tell overlapping roots apart
+			bool watching_single_file = false;
+			std::string filename;   // only used if watching a single file
+			std::shared_ptr<const PathFilter> filter;
+			Snapshot snapshot;
+			std::unique_ptr<Walk> walk; // set until the initial walk is done
+			std::shared_ptr<DirectoryIndex> index; // Options::index, set once the walk is done
+#ifdef _WIN32
+			// a read posted to the completion port, overlapped has to stay first so completions can be mapped back to it
+			struct Read
+			{
+				OVERLAPPED overlapped{};
+				std::vector<BYTE> buffer;
+				bool pending = false;
+			};
+
+			HANDLE directory = INVALID_HANDLE_VALUE;
+			std::array<Read, 2> reads; // one is always outstanding while the other one's buffer is parsed
+			int pending_reads = 0;
+			bool broken = false;  // the directory went away or can't be read anymore, it is left alone from then on
+			bool closing = false; // removed, waiting for its cancelled reads to come back before it can be freed
+#elif __unix__
+			int watch = -1;
+			int mount = -1;         // fanotify only, the root's directory, to open the handles the kernel reports against
+			std::uint64_t fsid = 0; // fanotify only, the filesystem the root lives on
+#endif // __unix__
+		};
+		std::vector<std::unique_ptr<Root>> _roots;
+
+		// roots are opened by the caller and handed to the watch thread through _commands, a null root removes remove_id
+		struct Command
+		{
+			std::unique_ptr<Root> root;
+			RootId remove_id;
+		};
+
+		struct RootInfo
+		{
+			std::string path;
+			std::string directory;
+			std::string canonical;
+			std::shared_ptr<const PathFilter> filter;
+			bool ready = false;
+			std::shared_ptr<const DirectoryIndex> index; // the root's, once it is ready
+		};
+
+		mutable std::mutex _command_mutex;
+		std::vector<Command> _commands;
+		std::atomic_bool _commands_pending{false};
+		std::map<RootId, RootInfo> _root_info; // every root handed out and not removed yet
+		RootId _next_root = 0;
+
+#ifdef _WIN32
+		// every root's directory handle is associated with it, keyed by the Root itself;
+		// a completion without an OVERLAPPED is a wake-up, for commands or destroy()
+		HANDLE _completion_port = nullptr;
+
+		// removed roots whose reads have not come back yet
+		std::vector<std::unique_ptr<Root>> _closing_roots;
+
+		const DWORD _listen_filters =
+			FILE_NOTIFY_CHANGE_SECURITY |
+			FILE_NOTIFY_CHANGE_CREATION |
+			FILE_NOTIFY_CHANGE_LAST_ACCESS |
+			FILE_NOTIFY_CHANGE_LAST_WRITE |
+			FILE_NOTIFY_CHANGE_SIZE |
+			FILE_NOTIFY_CHANGE_ATTRIBUTES |
+			FILE_NOTIFY_CHANGE_DIR_NAME |
+			FILE_NOTIFY_CHANGE_FILE_NAME;
+
+		// what each FILE_ACTION_* is reported as, indexed by the action less FILE_ACTION_ADDED
+		static constexpr Event _action_events[] = { Event::CREATED, Event::DELETED, Event::CHANGED, Event::RENAMED_OLD, Event::RENAMED_NEW };
+		static_assert(FILE_ACTION_REMOVED == FILE_ACTION_ADDED + 1 && FILE_ACTION_MODIFIED == FILE_ACTION_ADDED + 2 &&
+			FILE_ACTION_RENAMED_OLD_NAME == FILE_ACTION_ADDED + 3 && FILE_ACTION_RENAMED_NEW_NAME == FILE_ACTION_ADDED + 4, "FILE_ACTION_* are consecutive");
+#endif // WIN32
+
+#if __unix__
+		// every armed directory of every root by its watch descriptor; inotify never hands a descriptor out twice,
+		// so a tree whose directories come and go would keep growing anything indexed by them
+		struct WatchEntry {
+			Root* root = nullptr;
+			std::string path; // relative to the root with a trailing '/', empty for the root itself
+		};
+
+		std::unordered_map<int, WatchEntry> _watches;
+		std::atomic_bool _watch_limit_reported{false};
+
+		// directories the walkers armed, moved into _watches by the watch thread before it parses the next read.
+		// _arm_mutex is held from inotify_add_watch() until the entry is in _armed, so a read that reports on a watch
+		// always finds it here or in _watches.
+		struct Armed {
+			int watch;
+			Root* root;
+			std::string path;
+		};
+		std::mutex _arm_mutex;
+		std::vector<Armed> _armed;
+		std::size_t _walking = 0; // roots being walked, only touched by the watch thread
+
+		int _inotify = -1;
+		int _fanotify = -1;
+		int _wake_event = -1; // eventfd that gets the watch thread out of poll(), for commands or destroy()
+
+		// fanotify: directory handle (fsid, type and handle bytes) -> the root it is under, nullptr for none,
+		// and its path relative to that root. Dropped whenever a directory moves or goes away and whenever roots change.
+		struct HandlePath {
+			Root* root = nullptr;
+			std::string path;
+		};
+		std::unordered_map<std::string, HandlePath> _handle_paths;
+		std::string _handle_key;          // scratch, so looking up a handle does not allocate
+		std::vector<char> _handle_buffer; // scratch, open_by_handle_at() wants a mutable handle
+		std::string _handle_directory;    // scratch, survives _handle_paths being dropped mid event
+		std::string _rename_directory;    // scratch, the same for the old side of a FAN_RENAME
+		static constexpr std::size_t _max_handle_paths = 64 * 1024;
+
+		static constexpr std::uint64_t _fanotify_filters = 0
+#ifdef FILEWATCH_FANOTIFY
+			| FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_ONDIR
+#endif // FILEWATCH_FANOTIFY
+			;
+
+		// FAN_RENAME (Linux 5.17) reports both names of a rename in one event. Older kernels only report its two halves,
+		// with nothing to pair them up by, so they are told as a deletion and a creation
+		static constexpr std::uint64_t _fanotify_move_filters = 0
+#ifdef FILEWATCH_FANOTIFY
+			| FAN_MOVED_FROM | FAN_MOVED_TO
+#endif // FILEWATCH_FANOTIFY
+			;
+		static constexpr std::uint64_t _fanotify_rename_filters = 0
+#ifdef FAN_RENAME
+			| FAN_RENAME
+#else
+			| _fanotify_move_filters
+#endif // FAN_RENAME
+			;
+		std::uint64_t _fanotify_mask = _fanotify_filters | _fanotify_rename_filters; // what filesystems are marked with
+
+		// the IN_MOVED_FROM half of a rename, waiting for its IN_MOVED_TO
+		struct PendingMove {
+			bool active = false;
+			std::uint32_t cookie = 0;
+			bool directory = false;
+			Root* root = nullptr;
+			std::string path;
+		};
+		PendingMove _pending_move;
+
+		// how long an IN_MOVED_FROM at the very end of a read waits for its other half before it counts as moved out of the tree
+		static constexpr int _move_timeout_ms = 10;
+
+		static constexpr std::uint32_t _listen_filters = IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+		const static std::size_t event_size = (sizeof(struct inotify_event));
+#endif // __unix__
+
+		void report_error(const std::string& message) const
+		{
+			if (_options.on_error)
+				_options.on_error("filewatch: " + message);
+		}
+
+		// creates the handles every root shares
+		void open()
+		{
+			_destroy = false;
+#ifdef _WIN32
+			// one thread dequeues, so one is all the port lets run at a time
+			_completion_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+			if (!_completion_port)
+				throw std::system_error(GetLastError(), std::system_category());
+			_options.backend = Backend::NATIVE;
+#elif __unix__
+			// non blocking, monitor_directory() waits in poll() so it can be woken up at any time
+#ifdef FILEWATCH_FANOTIFY
+			if (_options.backend == Backend::FANOTIFY)
+			{
+				_fanotify = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE);
+				_fanotify_mask = _fanotify_filters | _fanotify_rename_filters;
+				if (_fanotify < 0)
+				{
+					report_error(std::string("fanotify is not available (") + std::strerror(errno) + "), falling back to inotify");
+					_options.backend = Backend::NATIVE;
+				}
+			}
+#else
+			_options.backend = Backend::NATIVE;
+#endif // FILEWATCH_FANOTIFY
+
+			if (_options.backend == Backend::NATIVE)
+			{
+				_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+				if (_inotify < 0)
+					throw std::system_error(errno, std::system_category());
+			}
+
+			_wake_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			if (_wake_event < 0)
+			{
+				const int error = errno;
+				release();
+				throw std::system_error(error, std::system_category());
+			}
+#endif // __unix__
+		}
+
+		void init()
+		{
+			if (_options.delivery == Delivery::THREADED)
+			{
+				_callback_thread = std::move(std::thread([this]() {
+					try
+					{
+						callback_thread();
+					}
+					catch (...)
+					{
+						try
+						{
+							_running.set_exception(std::current_exception());
+						}
+						catch (...) {} // set_exception() may throw too
+					}
+				}));
+			}
+
+			_watch_thread = std::move(std::thread([this]() {
+				try
+				{
+					monitor_directory();
+				}
+				catch (...)
+				{
+					try {
+						_running.set_exception(std::current_exception());
+					}
+					catch (...) {} // set_exception() may throw too
+				}
+			}));
+
+			std::future<void> future = _running.get_future();
+			future.get(); //block until the monitor_directory is up and running
+		}
+
+		void wake()
+		{
+#ifdef _WIN32
+			PostQueuedCompletionStatus(_completion_port, 0, 0, nullptr);
+#elif __unix__
+			const std::uint64_t wake = 1;
+			if (write(_wake_event, &wake, sizeof(wake)) < 0) {} // can only fail once the counter is already set
+#endif // __unix__
+		}
+
+		void destroy()
+		{
+			_destroy = true;
+			_running = std::promise<void>();
+			wake();
+			_cv.notify_all();
+			{
+				// a watch thread waiting for room checks _destroy under this lock, so the notification can't slip past it
+				std::lock_guard<std::mutex> lock(_callback_mutex);
+			}
+			_space_cv.notify_all();
+			if (_watch_thread.joinable())
+				_watch_thread.join();
+			if (_callback_thread.joinable())
+				_callback_thread.join();
+
+			release();
+		}
+
+		// closes every root and the shared handles, the threads must not be running anymore
+		void release()
+		{
+			std::lock_guard<std::mutex> lock(_command_mutex);
+			for (Command& command : _commands)
+			{
+				if (command.root)
+					close_root(*command.root);
+			}
+			_commands.clear();
+			_commands_pending = false;
+
+			// walkers still going use the shared handles, they are stopped before anything is closed
+			for (auto& root : _roots)
+				root->walk.reset();
+			_walks_done = false;
+
+			for (auto& root : _roots)
+				close_root(*root);
+			_roots.clear();
+			_root_info.clear();
+			_next_root = 0;
+			_dirty.clear();
+
+			_journal.reset();
+			_journal_opened = false;
+			_journal_entry.clear();
+			_since_last_run = ChangesSinceLastRun();
+			_since_last_run_known = false;
+#ifdef _WIN32
+			_closing_roots.clear();
+			if (_completion_port)
+				CloseHandle(_completion_port);
+			_completion_port = nullptr;
+#elif __unix__
+			_watches.clear();
+			_watch_limit_reported = false;
+			_armed.clear();
+			_walking = 0;
+			_pending_move = PendingMove();
+
+			// takes every watch (or mark) still armed with it
+			if (_inotify >= 0)
+				close(_inotify);
+			_inotify = -1;
+			if (_fanotify >= 0)
+				close(_fanotify);
+			_fanotify = -1;
+			_handle_paths.clear();
+			if (_wake_event >= 0)
+				close(_wake_event);
+			_wake_event = -1;
+#endif // __unix__
+		}
+
+		// a filesystem fanotify can't mark (FUSE, some network mounts) sends the watch back to inotify, which works everywhere
+		void add_first_root(const std::string& path)
+		{
+			if (_options.backend == Backend::FANOTIFY)
+			{
+				try
+				{
+					add_root(path);
+					return;
+				}
+				catch (const std::system_error& error)
+				{
+					report_error("can't watch " + path + " with fanotify (" + error.what() + "), falling back to inotify");
+				}
+
+				release();
+				_options.backend = Backend::NATIVE;
+				open();
+			}
+
+			add_root(path);
+		}
+
+		// opens the roots of other under the same ids
+		void copy_roots(const BasicFileWatch& other)
+		{
+			std::map<RootId, RootInfo> roots;
+			{
+				std::lock_guard<std::mutex> lock(other._command_mutex);
+				roots = other._root_info;
+			}
+
+			std::lock_guard<std::mutex> lock(_command_mutex);
+			for (const auto& root : roots)
+				open_root(root.first, root.second.path, root.second.filter);
+		}
+
+		// _command_mutex must be held
+		RootId open_root(const RootId id, const std::string& path, std::shared_ptr<const PathFilter> filter)
+		{
+			std::unique_ptr<Root> root = std::make_unique<Root>();
+			root->id = id;
+			root->filter = std::move(filter);
+			locate_root(*root, path);
+
+			for (const auto& other : _root_info)
+			{
+				const std::string& canonical = other.second.canonical;
+				if (canonical.compare(0, root->canonical.size(), root->canonical) == 0 || root->canonical.compare(0, canonical.size(), canonical) == 0)
+					throw std::invalid_argument("filewatch: " + path + " overlaps " + other.second.path + ", which is already watched");
+			}
+
+			arm_root(*root);
+
+			_root_info[id] = RootInfo{ path, root->watch_root, root->canonical, root->filter, false, nullptr };
+			_next_root = std::max(_next_root, id + 1);
+			_commands.push_back(Command{ std::move(root), 0 });
+			_commands_pending = true;
+			wake();
+			return id;
+		}
+
+		// only ever called from the watch thread
+		void apply_commands(EventBatch& parsed_information)
+		{
+			if (!_commands_pending.exchange(false)) return;
+
+			std::vector<Command> commands;
+			{
+				std::lock_guard<std::mutex> lock(_command_mutex);
+				commands.swap(_commands);
+			}
+
+			for (Command& command : commands)
+			{
+				if (command.root)
+					start_root(std::move(command.root), parsed_information);
+				else
+					stop_root(command.remove_id);
+			}
+		}
+
+		const PathParts split_directory_and_file(const std::string& path) const
+		{
+			const auto predict = [](typename std::string::value_type character) {
+#ifdef _WIN32
+				return character == _T('\\') || character == _T('/');
+#elif __unix__
+				return character == '/';
+#endif // __unix__
+			};
+#ifdef _WIN32
+#define _UNICODE
+			const std::string this_directory = _T("./");
+#elif __unix__
+			const std::string this_directory = "./";
+#endif // __unix__
+
+			const std::string::const_iterator pivot = std::find_if(path.rbegin(), path.rend(), predict).base();
+			//if the path is something like "test.txt" there will be no directoy part, however we still need one, so insert './'
+			const std::string extracted_directory = std::string(path.begin(), pivot);
+			std::string directory = (extracted_directory.size() > 0) ? extracted_directory : this_directory;
+
+			const std::string filename = std::string(pivot, path.end());
+			return PathParts(directory, filename);
+		}
+
+		// only ever called from the watch thread
+		bool pass_filter(const Root& root, const std::string_view file_path)
+		{
+			if (root.watching_single_file)
+			{
+				//if we are watching a single file, only that file should trigger action
+				if (PathFilter::file_name(file_path) != root.filename) return false;
+			}
+
+			if (_filter_changed.exchange(false))
+			{
+				std::lock_guard<std::mutex> lock(_filter_mutex);
+				_filter = _pending_filter;
+			}
+
+			if (root.filter != nullptr && !root.filter->passes(file_path)) return false;
+
+			if (!_journal_entry.empty() && root.id == 0 && file_path == _journal_entry) return false;
+
+			if (_ignoring.load(std::memory_order_relaxed) > 0 && ignoring(root.id, file_path)) return false;
+
+			return _filter == nullptr || _filter->passes(file_path);
+		}
+
+		// paths compare with '/' for separators, and on Windows without regard to case
+		static void ignore_key(const std::string_view path, std::string& key)
+		{
+			std::size_t start = 0;
+			while (start < path.size() && PathFilter::is_separator(path[start]))
+				++start;
+
+			key.assign(path.data() + start, path.size() - start);
+			for (char& character : key)
+			{
+				if (character == '\\') character = '/';
+#ifdef _WIN32
+				else character = static_cast<char>(std::tolower(static_cast<unsigned char>(character)));
+#endif // _WIN32
+			}
+		}
+
+		bool ignoring(const RootId id, const std::string_view file_path)
+		{
+			ignore_key(file_path, _ignore_path);
+
+			std::lock_guard<std::mutex> lock(_ignore_mutex);
+			const auto root = _ignored.find(id);
+			if (root == _ignored.end()) return false;
+
+			const auto found = root->second.find(_ignore_path);
+			if (found == root->second.end()) return false;
+
+			if (found->second <= Clock::now())
+			{
+				root->second.erase(found);
+				if (root->second.empty())
+					_ignored.erase(root);
+				_ignoring = _ignored.size();
+				return false;
+			}
+
+			++_ignored_events;
+			return true;
+		}
+
+		// keeps the snapshot in line with an event that is about to be reported
+		void track_state(Root& root, const std::string_view relative_path, const Event type)
+		{
+			if (!_options.resync) return;
+
+			_state_path.assign(relative_path.data(), relative_path.size());
+			if (root.walk)
+				root.walk->touched.insert(_state_path);
+
+			EntryState state;
+			if (type != Event::DELETED && type != Event::RENAMED_OLD)
+			{
+				// an entry gone again by the time its event is read stays in as well, the event says it is there;
+				// the DELETED behind it takes it out, or if that was lost to an overflow the resync does
+				if (!stat_entry(root, _state_path, state))
+					state = EntryState();
+				root.snapshot[_state_path] = state;
+				state_changed(root, _state_path, &state);
+			}
+			else
+			{
+				const auto found = root.snapshot.find(_state_path);
+				if (found == root.snapshot.end()) return;
+
+				const bool directory = found->second.directory;
+				root.snapshot.erase(found);
+				state_changed(root, _state_path, nullptr);
+
+				// a directory moved out of the root goes with everything below it, nothing else tells about those
+				if (directory)
+					forget_state_tree(root, _state_path + "/");
+			}
+		}
+
+		// takes every entry under prefix out of the snapshot
+		void forget_state_tree(Root& root, const std::string& prefix)
+		{
+			if (root.walk)
+				root.walk->moved.push_back(prefix);
+
+			std::vector<std::string> gone;
+			for (auto entry = root.snapshot.begin(); entry != root.snapshot.end();)
+			{
+				if (entry->first.compare(0, prefix.size(), prefix) == 0)
+				{
+					gone.push_back(entry->first);
+					entry = root.snapshot.erase(entry);
+				}
+				else
+				{
+					++entry;
+				}
+			}
+
+			for (const std::string& path : gone)
+				state_changed(root, path, nullptr);
+		}
+
+		// renames an entry in the snapshot, along with everything below it if it is a directory
+		void move_state(Root& root, const std::string_view old_path, const std::string_view new_path)
+		{
+			if (!_options.resync) return;
+
+			_state_path.assign(old_path.data(), old_path.size());
+			const auto found = root.snapshot.find(_state_path);
+			const bool directory = found != root.snapshot.end() && found->second.directory;
+			if (root.walk)
+			{
+				// whatever the walk saw under a directory that moved is under a path that is gone
+				EntryState state;
+				if (directory || (stat_entry(root, std::string(new_path), state) && state.directory))
+					root.walk->moved.push_back(_state_path + "/");
+			}
+
+			if (directory)
+			{
+				const std::string old_prefix = _state_path + "/";
+				std::vector<std::pair<std::string, EntryState>> moved;
+				for (auto entry = root.snapshot.begin(); entry != root.snapshot.end();)
+				{
+					if (entry->first.compare(0, old_prefix.size(), old_prefix) == 0)
+					{
+						moved.emplace_back(std::string(new_path) + entry->first.substr(old_path.size()), entry->second);
+						entry = root.snapshot.erase(entry);
+					}
+					else
+					{
+						++entry;
+					}
+				}
+
+				for (auto& entry : moved)
+				{
+					state_changed(root, std::string(old_path) + entry.first.substr(new_path.size()), nullptr);
+					root.snapshot[entry.first] = entry.second;
+					state_changed(root, entry.first, &entry.second);
+				}
+			}
+
+			track_state(root, old_path, Event::DELETED);
+			track_state(root, new_path, Event::CREATED);
+		}
+
+		// Commits the rename built in parsed_information. When the filter only lets one side of it through,
+		// that side is reported as a plain creation or deletion instead.
+		void commit_rename(Root& root, EventBatch& parsed_information, const Event old_type = Event::DELETED, const Event new_type = Event::CREATED)
+		{
+			move_state(root, parsed_information.pending_old(), parsed_information.pending());
+
+			const bool old_passes = pass_filter(root, parsed_information.pending_old());
+			const bool new_passes = pass_filter(root, parsed_information.pending());
+			if (old_passes && new_passes)
+				parsed_information.commit(Event::RENAMED);
+			else if (new_passes)
+				parsed_information.commit_new(new_type);
+			else if (old_passes)
+				parsed_information.commit_old(old_type);
+			else
+				parsed_information.rollback();
+		}
+
+		// Reports the queue overflow and, with resync on, whatever changed on disk since the snapshot was taken
+		void resync(Root& root, EventBatch& parsed_information)
+		{
+			parsed_information.set_root(root.id);
+			parsed_information.emplace_back(std::string_view(), Event::QUEUE_OVERFLOW);
+			if (!_options.resync) return;
+
+			// the walk's snapshot is what is diffed against, so it has to be complete first
+			if (root.walk)
+			{
+				root.walk->walker->wait();
+				finish_walk(root, parsed_information);
+			}
+
+			Snapshot current;
+			take_snapshot(root, &current, parsed_information);
+
+			diff_snapshots(root.snapshot, current, [this, &root, &parsed_information](const std::string& path, const Event type) {
+				if (pass_filter(root, path))
+					parsed_information.emplace_back(path, type);
+			});
+
+			root.snapshot.swap(current);
+			if (root.index)
+				root.index->assign(root.snapshot);
+			rewrite_journal(root);
+		}
+
+		// hands report(path, type) the CREATED, CHANGED and DELETED entries that tell before from after
+		template <typename Report>
+		static void diff_snapshots(const Snapshot& before, const Snapshot& after, Report&& report)
+		{
+			for (const auto& entry : after)
+			{
+				const auto previous = before.find(entry.first);
+				if (previous == before.end())
+				{
+					report(entry.first, Event::CREATED);
+				}
+				else if (!entry.second.directory && (
+					previous->second.modified != entry.second.modified ||
+					previous->second.size != entry.second.size ||
+					previous->second.inode != entry.second.inode))
+				{
+					report(entry.first, Event::CHANGED);
+				}
+			}
+
+			for (const auto& entry : before)
+			{
+				if (after.find(entry.first) == after.end())
+					report(entry.first, Event::DELETED);
+			}
+		}
+
+		// The first root's snapshot is complete: what the journal remembers of the last run is compared against it,
+		// then the journal starts over from it. A journal that can't be opened or written is given up on, loudly.
+		void open_journal(Root& root)
+		{
+			if (_journal_opened || _options.journal.empty() || !_options.resync || root.id != 0) return;
+			_journal_opened = true;
+
+			ChangesSinceLastRun changes;
+			ChangeJournal::State previous;
+			try
+			{
+				_journal = std::make_unique<ChangeJournal>(_options.journal, root.canonical, previous);
+				changes.fresh = !_journal->intact();
+				_journal->rewrite(root.snapshot);
+			}
+			catch (const std::exception& error)
+			{
+				report_error("can't keep a journal in " + _options.journal + " (" + error.what() + ")");
+				_journal.reset();
+				return;
+			}
+
+			_journal_entry = relative_to_root(root, _options.journal);
+			diff_snapshots(previous, root.snapshot, [this, &root, &changes](const std::string& path, const Event type) {
+				if (pass_filter(root, path))
+					changes.changes.emplace_back(path, type);
+			});
+
+			std::lock_guard<std::mutex> lock(_command_mutex);
+			_since_last_run = std::move(changes);
+			_since_last_run_known = true;
+		}
+
+		// keeps the index and the journal in line with a change to the snapshot of root, state is nullptr once the entry is gone
+		void state_changed(Root& root, const std::string_view path, const EntryState* state)
+		{
+			if (root.index)
+			{
+				if (state != nullptr)
+					root.index->set(path, *state);
+				else
+					root.index->erase(path);
+			}
+			journal_state(root, path, state);
+		}
+
+		// records a change to the snapshot of root into the journal, when root is the one it keeps
+		void journal_state(const Root& root, const std::string_view path, const EntryState* state)
+		{
+			if (!_journal || root.id != 0 || path == _journal_entry) return;
+
+			try
+			{
+				// root.snapshot has the change already; only appending, the file would grow without bound on a tree that keeps changing
+				_journal->record(path, state);
+				if (_journal->records() > 2 * root.snapshot.size() + 4096)
+					_journal->rewrite(root.snapshot);
+			}
+			catch (const std::exception& error)
+			{
+				report_error("journal " + _options.journal + " can't be written anymore (" + error.what() + ")");
+				_journal.reset();
+			}
+		}
+
+		void rewrite_journal(const Root& root)
+		{
+			if (!_journal || root.id != 0) return;
+
+			try
+			{
+				_journal->rewrite(root.snapshot);
+			}
+			catch (const std::exception& error)
+			{
+				report_error("journal " + _options.journal + " can't be written anymore (" + error.what() + ")");
+				_journal.reset();
+			}
+		}
+
+		// Walks a new root on ParallelWalker threads, which arm and snapshot it while the watch thread goes on reporting
+		// events of what is armed already. Event::READY follows once the walk is done, right away when there is none.
+		void start_walk(Root& root, EventBatch& parsed_information)
+		{
+#ifdef _WIN32
+			const bool walk = !root.watching_single_file && _options.resync; // one read covers the whole tree
+#elif __unix__
+			const bool walk = !root.watching_single_file && (_options.backend == Backend::NATIVE || _options.resync);
+#endif // __unix__
+			if (!walk)
+			{
+				take_snapshot(root, _options.resync ? &root.snapshot : nullptr, parsed_information);
+				report_ready(root, parsed_information);
+				return;
+			}
+
+			const std::size_t workers = _options.walk_threads > 0 ? _options.walk_threads : ParallelWalker::default_workers();
+			root.walk = std::make_unique<Walk>();
+			Walk& state = *root.walk;
+			if (_options.resync)
+				state.snapshots.resize(workers);
+
+			state.walker = std::make_unique<ParallelWalker>(std::string(), workers,
+				[this, &root, &state](const std::size_t worker, const std::string& directory, std::vector<std::string>& subdirectories) {
+					walk_directory(root, directory, subdirectories, state.snapshots.empty() ? nullptr : &state.snapshots[worker]);
+				},
+				[this, &state]() {
+					state.done = true;
+					_walks_done = true;
+					wake();
+				});
+#if __unix__
+			++_walking;
+#endif // __unix__
+		}
+
+		// finishes every walk that is done, only ever called from the watch thread
+		void collect_walks(EventBatch& parsed_information)
+		{
+			if (!_walks_done.exchange(false)) return;
+
+			for (auto& root : _roots)
+			{
+				if (root->walk && root->walk->done)
+					finish_walk(*root, parsed_information);
+			}
+		}
+
+		// the walk of root must be over, merges what it found and reports the root ready
+		void finish_walk(Root& root, EventBatch& parsed_information)
+		{
+			root.walk->walker.reset();
+#if __unix__
+			apply_armed();
+			--_walking;
+#endif // __unix__
+
+			// what events touched meanwhile is newer than what the walk saw, whether it is in the snapshot or was taken
+			// out of it again: a deleted entry put back from the walk would be a deletion every resync reports anew
+			const Walk& walk = *root.walk;
+			for (const Snapshot& snapshot : walk.snapshots)
+			{
+				for (const auto& entry : snapshot)
+				{
+					const bool stale = walk.touched.count(entry.first) > 0 || std::any_of(walk.moved.begin(), walk.moved.end(), [&entry](const std::string& prefix) {
+						return entry.first.compare(0, prefix.size(), prefix) == 0;
+					});
+					if (!stale)
+						root.snapshot.emplace(entry.first, entry.second);
+				}
+			}
+			root.walk.reset();
+
+			report_ready(root, parsed_information);
+		}
+
+		// stops the walk of a root that is going away, nothing is reported
+		void cancel_walk(Root& root)
+		{
+			if (!root.walk) return;
+
+			root.walk->walker->cancel();
+			root.walk.reset();
+#if __unix__
+			apply_armed();
+			--_walking;
+#endif // __unix__
+		}
+
+		void report_ready(Root& root, EventBatch& parsed_information)
+		{
+			open_journal(root);
+			if (_options.index && _options.resync)
+			{
+				root.index = std::make_shared<DirectoryIndex>();
+				root.index->assign(root.snapshot);
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(_command_mutex);
+				const auto found = _root_info.find(root.id);
+				if (found != _root_info.end())
+				{
+					found->second.ready = true;
+					found->second.index = root.index;
+				}
+			}
+
+			parsed_information.set_root(root.id);
+			parsed_information.emplace_back(std::string_view(), Event::READY);
+		}
+
+#ifdef _WIN32
+		void locate_root(Root& root, const std::string& path)
+		{
+			DWORD file_info = GetFileAttributesW(widen(path).c_str());
+			if (file_info == INVALID_FILE_ATTRIBUTES)
+				throw std::system_error(GetLastError(), std::system_category());
+
+			root.watching_single_file = (file_info & FILE_ATTRIBUTE_DIRECTORY) == false;
+			if (root.watching_single_file)
+			{
+				const auto parsed_path = split_directory_and_file(path);
+				root.filename = parsed_path.filename;
+				root.watch_root = parsed_path.directory;
+			}
+			else
+			{
+				root.watch_root = path;
+			}
+
+			if (!full_path_of(root.watch_root, root.canonical))
+				throw std::system_error(GetLastError(), std::system_category());
+
+			// paths are case insensitive here, compare them that way
+			for (char& character : root.canonical)
+				character = static_cast<char>(std::tolower(static_cast<unsigned char>(character)));
+			if (root.canonical.back() != '/')
+				root.canonical.push_back('/');
+		}
+
+		// the absolute path of path in UTF-8 with '/' separators, however long it is
+		static bool full_path_of(const std::string& path, std::string& full_path)
+		{
+			const std::wstring wide = widen(path);
+			std::wstring buffer(MAX_PATH, L'\0');
+			DWORD length = GetFullPathNameW(wide.c_str(), static_cast<DWORD>(buffer.size()), &buffer[0], nullptr);
+			if (length >= buffer.size())
+			{
+				// too small, length is what it takes with the terminator
+				buffer.resize(length);
+				length = GetFullPathNameW(wide.c_str(), static_cast<DWORD>(buffer.size()), &buffer[0], nullptr);
+			}
+			if (length == 0 || length >= buffer.size()) return false;
+
+			full_path.clear();
+			append_utf8(buffer.data(), length, full_path, true);
+			return true;
+		}
+
+		// path relative to root when it is somewhere below it, empty otherwise
+		std::string relative_to_root(const Root& root, const std::string& path) const
+		{
+			std::string relative;
+			if (!full_path_of(path, relative) || relative.size() < root.canonical.size()) return std::string();
+
+			// canonical is lower case already, the rest keeps the case events will report it with
+			for (std::size_t i = 0; i < root.canonical.size(); ++i)
+			{
+				if (std::tolower(static_cast<unsigned char>(relative[i])) != root.canonical[i]) return std::string();
+			}
+			return relative.substr(root.canonical.size());
+		}
+
+		// _command_mutex must be held
+		void arm_root(Root& root)
+		{
+			root.directory = CreateFileW(
+				widen(root.watch_root).c_str(),                         // pointer to the file name
+				FILE_LIST_DIRECTORY,                                    // access (read/write) mode
+				FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, // share mode
+				nullptr,                                                // security descriptor
+				OPEN_EXISTING,                                          // how to create
+				FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,      // file attributes
+				nullptr);                                               // file with attributes to copy
+
+			if (root.directory == INVALID_HANDLE_VALUE)
+				throw std::system_error(GetLastError(), std::system_category());
+
+			if (!CreateIoCompletionPort(root.directory, _completion_port, reinterpret_cast<ULONG_PTR>(&root), 0))
+			{
+				const DWORD error = GetLastError();
+				close_root(root);
+				throw std::system_error(error, std::system_category());
+			}
+
+			for (typename Root::Read& read : root.reads)
+				read.buffer.resize(_buffer_size);
+		}
+
+		// posts both reads and starts the walk that takes the snapshot
+		void start_root(std::unique_ptr<Root> owned_root, EventBatch& parsed_information)
+		{
+			Root& root = *owned_root;
+			_roots.push_back(std::move(owned_root));
+
+			// taken once the reads are posted, so nothing that happens during the scan goes unnoticed
+			for (typename Root::Read& read : root.reads)
+				start_read(root, read);
+			start_walk(root, parsed_information);
+		}
+
+		// the kernel may still be writing into the reads' buffers, so the root is only freed once both came back
+		void stop_root(const RootId id)
+		{
+			for (auto root = _roots.begin(); root != _roots.end(); ++root)
+			{
+				if ((*root)->id != id) continue;
+
+				std::unique_ptr<Root> closing = std::move(*root);
+				_roots.erase(root);
+
+				cancel_walk(*closing);
+				closing->closing = true;
+				if (closing->pending_reads > 0)
+				{
+					CancelIoEx(closing->directory, nullptr);
+					_closing_roots.push_back(std::move(closing));
+				}
+				else
+				{
+					close_root(*closing);
+				}
+				return;
+			}
+		}
+
+		// a closing root had one of its cancelled reads come back
+		void finish_closing(Root& root)
+		{
+			if (root.pending_reads > 0) return;
+
+			close_root(root);
+			_closing_roots.erase(std::find_if(_closing_roots.begin(), _closing_roots.end(), [&root](const std::unique_ptr<Root>& closing) {
+				return closing.get() == &root;
+			}));
+		}
+
+		// no read of root may be outstanding anymore
+		void close_root(Root& root)
+		{
+			if (root.directory != INVALID_HANDLE_VALUE)
+				CloseHandle(root.directory);
+			root.directory = INVALID_HANDLE_VALUE;
+		}
+
+		static std::int64_t to_ticks(const FILETIME& time)
+		{
+			return static_cast<std::int64_t>((static_cast<std::uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime);
+		}
+
+		bool stat_entry(const Root& root, const std::string& relative_path, EntryState& state)
+		{
+			WIN32_FILE_ATTRIBUTE_DATA data;
+			if (!GetFileAttributesExW(widen(root.watch_root + "/" + relative_path).c_str(), GetFileExInfoStandard, &data))
+				return false;
+
+			state.modified = to_ticks(data.ftLastWriteTime);
+			state.size = (static_cast<std::uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+			state.inode = 0;
+			state.directory = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			return true;
+		}
+
+		void take_snapshot(const Root& root, Snapshot* snapshot, EventBatch&)
+		{
+			if (snapshot == nullptr) return;
+
+			if (root.watching_single_file)
+			{
+				EntryState state;
+				if (stat_entry(root, root.filename, state))
+					(*snapshot)[root.filename] = state;
+				return;
+			}
+
+			std::vector<std::string> pending{ std::string() };
+			std::vector<std::string> subdirectories;
+			while (!pending.empty() && _destroy == false)
+			{
+				const std::string relative_directory = std::move(pending.back());
+				pending.pop_back();
+
+				walk_directory(root, relative_directory, subdirectories, snapshot);
+				for (std::string& subdirectory : subdirectories)
+					pending.push_back(std::move(subdirectory));
+				subdirectories.clear();
+			}
+		}
+
+		// records the entries of one directory into snapshot and appends its subdirectories, safe on any thread
+		void walk_directory(const Root& root, const std::string& relative_directory, std::vector<std::string>& subdirectories, Snapshot* snapshot)
+		{
+			if (_destroy || snapshot == nullptr) return;
+
+			WIN32_FIND_DATAW data;
+			HANDLE search = FindFirstFileExW(widen(root.watch_root + "/" + relative_directory + "*").c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+			if (search == INVALID_HANDLE_VALUE) return;
+
+			do
+			{
+				if (std::wcscmp(data.cFileName, L".") == 0 || std::wcscmp(data.cFileName, L"..") == 0) continue;
+
+				EntryState state;
+				state.modified = to_ticks(data.ftLastWriteTime);
+				state.size = (static_cast<std::uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+				state.directory = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+
+				// named the way events name it
+				std::string relative_path = relative_directory;
+				append_utf8(data.cFileName, std::wcslen(data.cFileName), relative_path);
+				(*snapshot)[relative_path] = state;
+
+				// reparse points are not followed, same as on Linux
+				if (state.directory && (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0)
+					subdirectories.push_back(relative_path + "/");
+			} while (FindNextFileW(search, &data));
+			FindClose(search);
+		}
+
+		// converted straight into the batch, with separators normalised to '/' on the way
+		static void append_name(EventBatch& parsed_information, const FILE_NOTIFY_INFORMATION& file_information)
+		{
+			parsed_information.append_utf16(file_information.FileName, file_information.FileNameLength / sizeof(WCHAR));
+		}
+
+		void start_read(Root& root, typename Root::Read& read)
+		{
+			read.overlapped = OVERLAPPED{};
+			if (ReadDirectoryChangesW(root.directory, read.buffer.data(), static_cast<DWORD>(read.buffer.size()), true, _listen_filters, nullptr, &read.overlapped, nullptr))
+			{
+				read.pending = true;
+				++root.pending_reads;
+			}
+			else
+			{
+				root.broken = true;
+			}
+		}
+
+		// parses a completed read of root into parsed_information
+		void read_changes(Root& root, const typename Root::Read& read, const DWORD bytes_returned, EventBatch& parsed_information)
+		{
+			parsed_information.set_root(root.id);
+
+			// the buffer overflowed and the system threw the changes away
+			if (bytes_returned == 0)
+			{
+				resync(root, parsed_information);
+				return;
+			}
+
+			const FILE_NOTIFY_INFORMATION* file_information = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(read.buffer.data());
+			do
+			{
+				const FILE_NOTIFY_INFORMATION* next_information = file_information->NextEntryOffset == 0 ? nullptr :
+					reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(reinterpret_cast<const BYTE*>(file_information) + file_information->NextEntryOffset);
+
+				parsed_information.begin();
+				append_name(parsed_information, *file_information);
+
+				// the two halves of a rename are always reported back to back
+				if (file_information->Action == FILE_ACTION_RENAMED_OLD_NAME && next_information != nullptr && next_information->Action == FILE_ACTION_RENAMED_NEW_NAME)
+				{
+					parsed_information.split();
+					append_name(parsed_information, *next_information);
+					commit_rename(root, parsed_information, Event::RENAMED_OLD, Event::RENAMED_NEW);
+
+					next_information = next_information->NextEntryOffset == 0 ? nullptr :
+						reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(reinterpret_cast<const BYTE*>(next_information) + next_information->NextEntryOffset);
+				}
+				else if (static_cast<std::size_t>(file_information->Action - FILE_ACTION_ADDED) < std::size(_action_events))
+				{
+					const Event type = _action_events[file_information->Action - FILE_ACTION_ADDED];
+					track_state(root, parsed_information.pending(), type);
+
+					if (pass_filter(root, parsed_information.pending()))
+						parsed_information.commit(type);
+					else
+						parsed_information.rollback();
+				}
+				else
+				{
+					// not an action Windows is documented to report
+					parsed_information.rollback();
+				}
+
+				if (next_information == nullptr) break;
+
+				file_information = next_information;
+			} while (true);
+		}
+
+		// Every root keeps two reads posted. A completed read is parsed while the other one is still outstanding and
+		// only posted again afterwards, so there is never a moment without a read waiting on the directory.
+		// Completions come out of the port in the order they happened, which keeps events in order across both buffers.
+		void monitor_directory()
+		{
+			EventBatch parsed_information;
+			_running.set_value();
+
+			while (_destroy == false)
+			{
+				parsed_information.set_captured(Clock::now());
+				apply_commands(parsed_information);
+				collect_walks(parsed_information);
+				if (!parsed_information.empty())
+					hand_over(parsed_information);
+
+				DWORD bytes_returned = 0;
+				ULONG_PTR key = 0;
+				OVERLAPPED* overlapped = nullptr;
+				const bool completed = GetQueuedCompletionStatus(_completion_port, &bytes_returned, &key, &overlapped, INFINITE) != FALSE;
+				parsed_information.set_captured(Clock::now());
+
+				// woken up for commands or destroy(), both are picked up at the top of the loop
+				if (overlapped == nullptr)
+				{
+					if (!completed)
+						throw std::system_error(GetLastError(), std::system_category());
+					continue;
+				}
+
+				Root& root = *reinterpret_cast<Root*>(key);
+				typename Root::Read& read = *reinterpret_cast<typename Root::Read*>(overlapped);
+				read.pending = false;
+				--root.pending_reads;
+
+				if (root.closing)
+				{
+					finish_closing(root);
+					continue;
+				}
+
+				if (completed)
+					read_changes(root, read, bytes_returned, parsed_information);
+				else if (GetLastError() == ERROR_NOTIFY_ENUM_DIR)
+					resync(root, parsed_information);
+				else
+					root.broken = true;
+
+				if (!root.broken)
+					start_read(root, read);
+
+				//dispatch callbacks
+				if (!parsed_information.empty())
+					hand_over(parsed_information);
+			}
+
+			// clean up running async io, the buffers have to outlive whatever the kernel still holds
+			for (auto& root : _roots)
+			{
+				root->closing = true;
+				if (root->pending_reads > 0)
+					CancelIoEx(root->directory, nullptr);
+			}
+
+			const auto outstanding = [this]() {
+				for (const auto& root : _roots)
+				{
+					if (root->pending_reads > 0) return true;
+				}
+				return !_closing_roots.empty();
+			};
+
+			while (outstanding())
+			{
+				DWORD bytes_returned = 0;
+				ULONG_PTR key = 0;
+				OVERLAPPED* overlapped = nullptr;
+				GetQueuedCompletionStatus(_completion_port, &bytes_returned, &key, &overlapped, INFINITE);
+				if (overlapped == nullptr) continue;
+
+				Root& root = *reinterpret_cast<Root*>(key);
+				reinterpret_cast<typename Root::Read*>(overlapped)->pending = false;
+				--root.pending_reads;
+				if (root.pending_reads == 0 && std::any_of(_closing_roots.begin(), _closing_roots.end(), [&root](const std::unique_ptr<Root>& closing) { return closing.get() == &root; }))
+					finish_closing(root);
+			}
+		}
+#endif // WIN32
+
+#if __unix__
+		void locate_root(Root& root, const std::string& path)
+		{
+			struct stat statbuf = {};
+			if (stat(path.c_str(), &statbuf) != 0)
+				throw std::system_error(errno, std::system_category());
+
+			root.watching_single_file = S_ISREG(statbuf.st_mode);
+			if (root.watching_single_file)
+			{
+				const PathParts parsed_path = split_directory_and_file(path);
+				root.filename = parsed_path.filename;
+				root.watch_root = parsed_path.directory;
+			}
+			else
+			{
+				root.watch_root = path;
+			}
+
+			char* resolved = realpath(root.watch_root.c_str(), nullptr);
+			if (resolved == nullptr)
+				throw std::system_error(errno, std::system_category());
+
+			root.canonical = resolved;
+			free(resolved);
+			if (root.canonical.back() != '/')
+				root.canonical.push_back('/');
+		}
+
+		// path relative to root when it is somewhere below it, empty otherwise
+		std::string relative_to_root(const Root& root, const std::string& path) const
+		{
+			char* resolved = realpath(path.c_str(), nullptr);
+			if (resolved == nullptr) return std::string();
+
+			const std::string canonical = resolved;
+			free(resolved);
+			if (canonical.compare(0, root.canonical.size(), root.canonical) != 0) return std::string();
+			return canonical.substr(root.canonical.size());
+		}
+
+		// _command_mutex must be held, inotify_add_watch and fanotify_mark are fine to call while the watch thread reads
+		void arm_root(Root& root)
+		{
+#ifdef FILEWATCH_FANOTIFY
+			if (_options.backend == Backend::FANOTIFY)
+			{
+				root.mount = ::open(root.watch_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				if (root.mount < 0)
+					throw std::system_error(errno, std::system_category());
+
+				// marking a filesystem twice for a second root on it just adds the same mask again
+				struct statfs filesystem = {};
+				bool marked = fstatfs(root.mount, &filesystem) == 0 && fanotify_mark(_fanotify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, _fanotify_mask, root.mount, nullptr) == 0;
+				if (!marked && errno == EINVAL && _fanotify_mask != (_fanotify_filters | _fanotify_move_filters))
+				{
+					// headers newer than the kernel, which does not know FAN_RENAME yet
+					_fanotify_mask = _fanotify_filters | _fanotify_move_filters;
+					marked = fanotify_mark(_fanotify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, _fanotify_mask, root.mount, nullptr) == 0;
+				}
+				if (!marked)
+				{
+					const int error = errno;
+					close_root(root);
+					throw std::system_error(error, std::system_category());
+				}
+
+				static_assert(sizeof(filesystem.f_fsid) == sizeof(root.fsid), "fsid_t is expected to be two ints");
+				std::memcpy(&root.fsid, &filesystem.f_fsid, sizeof(root.fsid));
+				return;
+			}
+#endif // FILEWATCH_FANOTIFY
+
+			root.watch = inotify_add_watch(_inotify, root.watch_root.c_str(), _listen_filters);
+			if (root.watch < 0)
+				throw std::system_error(errno, std::system_category());
+		}
+
+		// the rest of the tree is armed by the walk so adding a root never waits on it,
+		// anything under a directory that is not armed yet is simply not reported
+		void start_root(std::unique_ptr<Root> owned_root, EventBatch& parsed_information)
+		{
+			Root& root = *owned_root;
+			_roots.push_back(std::move(owned_root));
+
+			if (_options.backend == Backend::NATIVE)
+				track_watch(root.watch, root, std::string());
+			else
+				_handle_paths.clear(); // directories outside of every root may be inside this one
+
+			start_walk(root, parsed_information);
+		}
+
+		void stop_root(const RootId id)
+		{
+			for (auto root = _roots.begin(); root != _roots.end(); ++root)
+			{
+				if ((*root)->id != id) continue;
+
+				cancel_walk(**root);
+				for (auto watch = _watches.begin(); watch != _watches.end();)
+				{
+					if (watch->second.root == root->get())
+					{
+						inotify_rm_watch(_inotify, watch->first);
+						watch = _watches.erase(watch);
+					}
+					else
+					{
+						++watch;
+					}
+				}
+
+				if (_pending_move.root == root->get())
+					_pending_move = PendingMove();
+
+#ifdef FILEWATCH_FANOTIFY
+				if (_options.backend == Backend::FANOTIFY)
+				{
+					const std::uint64_t fsid = (*root)->fsid;
+					const bool shared = std::any_of(_roots.begin(), _roots.end(), [&](const std::unique_ptr<Root>& other) {
+						return other.get() != root->get() && other->fsid == fsid;
+					});
+					if (!shared)
+						fanotify_mark(_fanotify, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, _fanotify_mask, (*root)->mount, nullptr);
+					_handle_paths.clear();
+				}
+#endif // FILEWATCH_FANOTIFY
+
+				close_root(**root);
+				_roots.erase(root);
+				return;
+			}
+		}
+
+		// an inotify watch goes away with the instance or in stop_root(), all there is to close is the fanotify side
+		void close_root(Root& root)
+		{
+			if (root.mount >= 0)
+				close(root.mount);
+			root.mount = -1;
+		}
+
+		void track_watch(int watch, Root& root, std::string relative_path)
+		{
+			WatchEntry& entry = _watches[watch];
+			entry.root = &root;
+			entry.path = std::move(relative_path);
+		}
+
+		void drop_watch(int watch)
+		{
+			_watches.erase(watch);
+		}
+
+		// rewrites the path of every armed directory of root under old_prefix, both end with a '/'
+		void rename_watches(const Root& root, const std::string& old_prefix, const std::string& new_prefix)
+		{
+			for (auto& watch : _watches)
+			{
+				if (watch.second.root == &root && watch.second.path.compare(0, old_prefix.size(), old_prefix) == 0)
+					watch.second.path = new_prefix + watch.second.path.substr(old_prefix.size());
+			}
+		}
+
+		// a directory left the tree, its watches would otherwise keep following it around
+		void forget_watches(const Root& root, const std::string& prefix)
+		{
+			for (auto watch = _watches.begin(); watch != _watches.end();)
+			{
+				if (watch->second.root == &root && watch->second.path.compare(0, prefix.size(), prefix) == 0)
+				{
+					inotify_rm_watch(_inotify, watch->first);
+					watch = _watches.erase(watch);
+				}
+				else
+				{
+					++watch;
+				}
+			}
+		}
+
+		// relative_path is the directory's path relative to the root, with a trailing '/'
+		bool add_watch(Root& root, const std::string& relative_path)
+		{
+			const std::string full_path = root.watch_root + "/" + relative_path;
+			const int watch = inotify_add_watch(_inotify, full_path.c_str(), _listen_filters);
+			if (watch < 0)
+			{
+				report_watch_error();
+				return false;
+			}
+
+			track_watch(watch, root, relative_path);
+			return true;
+		}
+
+		void report_watch_error()
+		{
+			if (errno == ENOSPC && !_watch_limit_reported.exchange(true))
+				report_error("inotify watch limit reached, raise fs.inotify.max_user_watches to watch the whole tree");
+		}
+
+		// add_watch() for the walkers, the watch only reaches _watches through apply_armed()
+		bool arm_walked(Root& root, const std::string& relative_path)
+		{
+			const std::string full_path = root.watch_root + "/" + relative_path;
+			std::lock_guard<std::mutex> lock(_arm_mutex);
+			const int watch = inotify_add_watch(_inotify, full_path.c_str(), _listen_filters);
+			if (watch < 0)
+			{
+				report_watch_error();
+				return false;
+			}
+
+			_armed.push_back(Armed{ watch, &root, relative_path });
+			return true;
+		}
 
-		FileWatch(std::string path, std::function<void(const std::string& file, const Event event_type)> callback) :
-			_path(path),
-			_callback(callback),
-			_directory(get_directory(path))
+		// only ever called from the watch thread
+		void apply_armed()
 		{
-			init();
+			std::lock_guard<std::mutex> lock(_arm_mutex);
+			for (Armed& armed : _armed)
+				track_watch(armed.watch, *armed.root, std::move(armed.path));
+			_armed.clear();
 		}
 
-		~FileWatch() 
+		// Lists one directory for the walk of root: arms its subdirectories, appends the ones that could be armed
+		// and records every entry into snapshot, unless it is nullptr. Runs on the walker threads, several at a time.
+		void walk_directory(Root& root, const std::string& relative_directory, std::vector<std::string>& subdirectories, Snapshot* snapshot)
 		{
-			destroy();
-		}
+			if (_destroy) return;
 
-		FileWatch(const FileWatch& other) : FileWatch(other._path, other._callback) {}
+			DIR* directory = opendir((root.watch_root + "/" + relative_directory).c_str());
+			if (directory == nullptr) return;
 
-		FileWatch& operator=(const FileWatch& other)
-		{
-			if (this == &other) return *this;
+			while (const struct dirent* entry = readdir(directory))
+			{
+				if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0) continue;
 
-			destroy();
-			_path = other._path;
-			_callback = other._callback;
-			_directory = get_directory(other._path);
-			init();
-			return *this;
-		}
+				bool is_directory = entry->d_type == DT_DIR;
+				std::string relative_path = relative_directory + entry->d_name;
+				if (snapshot != nullptr || entry->d_type == DT_UNKNOWN)
+				{
+					struct stat statbuf = {};
+					if (fstatat(dirfd(directory), entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) continue;
 
-		// Const member variables don't let me implent moves nicely, if moves are really wanted std::unique_ptr should be used and move that.
-		FileWatch(FileWatch&&) = delete;
-		FileWatch& operator=(FileWatch&&) & = delete;
+					is_directory = S_ISDIR(statbuf.st_mode);
+					if (snapshot != nullptr)
+						(*snapshot)[relative_path] = to_state(statbuf);
+				}
 
-	private:
-		struct PathParts
+				if (is_directory)
+				{
+					relative_path.push_back('/');
+					if (_options.backend != Backend::NATIVE || arm_walked(root, relative_path))
+						subdirectories.push_back(std::move(relative_path));
+				}
+			}
+			closedir(directory);
+		}
+
+		// Arms every directory below relative_root, which must already be armed itself.
+		// When synthesize_events is set every entry found is reported as CREATED, which covers
+		// files that were written into a fresh directory before its watch existed.
+		// Every entry found is also recorded into snapshot, unless it is nullptr.
+		void watch_tree(Root& root, const std::string& relative_root, bool synthesize_events, EventBatch& parsed_information, Snapshot* snapshot)
 		{
-			PathParts(std::string _directory, std::string _filename) : directory(_directory), filename(_filename) {}
-			std::string directory;
-			std::string filename;
-		};
-		std::string _path;
+			parsed_information.set_root(root.id);
 
-		static constexpr std::size_t _buffer_size = 1024 * 256;
+			std::vector<std::string> pending{ relative_root };
+			while (!pending.empty() && _destroy == false)
+			{
+				const std::string relative_directory = std::move(pending.back());
+				pending.pop_back();
 
-		// only used if watch a single file
-		bool _watching_single_file = false;
-		std::string _filename;
+				const std::string full_path = root.watch_root + "/" + relative_directory;
+				DIR* directory = opendir(full_path.c_str());
+				if (directory == nullptr) continue;
 
-		std::atomic_bool _destroy{false};
+				while (const struct dirent* entry = readdir(directory))
+				{
+					if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0) continue;
 
-		std::function<void(const std::string& file, const Event event_type)> _callback;
+					bool is_directory = entry->d_type == DT_DIR;
+					std::string relative_path = relative_directory + entry->d_name;
+					if (snapshot != nullptr || entry->d_type == DT_UNKNOWN)
+					{
+						struct stat statbuf = {};
+						if (fstatat(dirfd(directory), entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) continue;
 
-		std::thread _watch_thread;
+						is_directory = S_ISDIR(statbuf.st_mode);
+						if (snapshot != nullptr)
+						{
+							const EntryState& state = (*snapshot)[relative_path] = to_state(statbuf);
+							if (snapshot == &root.snapshot)
+								state_changed(root, relative_path, &state);
+						}
+					}
 
-		std::condition_variable _cv;
-		std::mutex _callback_mutex;
-		std::vector<std::pair<std::string, Event>> _callback_information;
-		std::thread _callback_thread;
+					if (synthesize_events && pass_filter(root, relative_path))
+						parsed_information.emplace_back(relative_path, Event::CREATED);
 
-		std::promise<void> _running;
-#ifdef _WIN32
-		HANDLE _directory = nullptr;
-		HANDLE _close_event = nullptr;
+					if (is_directory)
+					{
+						relative_path.push_back('/');
+						if (_options.backend != Backend::NATIVE || add_watch(root, relative_path))
+							pending.push_back(std::move(relative_path));
+					}
+				}
+				closedir(directory);
+			}
+		}
 
-		const DWORD _listen_filters =
-			FILE_NOTIFY_CHANGE_SECURITY |
-			FILE_NOTIFY_CHANGE_CREATION |
-			FILE_NOTIFY_CHANGE_LAST_ACCESS |
-			FILE_NOTIFY_CHANGE_LAST_WRITE |
-			FILE_NOTIFY_CHANGE_SIZE |
-			FILE_NOTIFY_CHANGE_ATTRIBUTES |
-			FILE_NOTIFY_CHANGE_DIR_NAME |
-			FILE_NOTIFY_CHANGE_FILE_NAME;
+		static EntryState to_state(const struct stat& statbuf)
+		{
+			EntryState state;
+			state.modified = static_cast<std::int64_t>(statbuf.st_mtim.tv_sec) * 1000000000 + statbuf.st_mtim.tv_nsec;
+			state.size = static_cast<std::uint64_t>(statbuf.st_size);
+			state.inode = static_cast<std::uint64_t>(statbuf.st_ino);
+			state.directory = S_ISDIR(statbuf.st_mode);
+			return state;
+		}
 
-		const std::map<DWORD, Event> _event_type_mapping = {
-			std::pair(FILE_ACTION_ADDED, Event::CREATED),
-			std::pair(FILE_ACTION_REMOVED, Event::DELETED),
-			std::pair(FILE_ACTION_MODIFIED, Event::CHANGED),
-			std::pair(FILE_ACTION_RENAMED_OLD_NAME, Event::RENAMED_OLD),
-			std::pair(FILE_ACTION_RENAMED_NEW_NAME, Event::RENAMED_NEW)
-		};
-#endif // WIN32
+		bool stat_entry(const Root& root, const std::string& relative_path, EntryState& state)
+		{
+			struct stat statbuf = {};
+			if (fstatat(AT_FDCWD, (root.watch_root + "/" + relative_path).c_str(), &statbuf, AT_SYMLINK_NOFOLLOW) != 0)
+				return false;
 
-#if __unix__
-		struct FolderInfo {
-			int folder;
-			int watch;
-		};
+			state = to_state(statbuf);
+			return true;
+		}
 
-		FolderInfo _directory;
+		// arms the whole tree of root and records it into snapshot, unless it is nullptr
+		// fanotify has nothing to arm, without a snapshot to take there is no walk at all
+		void take_snapshot(Root& root, Snapshot* snapshot, EventBatch& parsed_information)
+		{
+			if (root.watching_single_file)
+			{
+				EntryState state;
+				if (snapshot != nullptr && stat_entry(root, root.filename, state))
+					(*snapshot)[root.filename] = state;
+				return;
+			}
 
-		const std::uint32_t _listen_filters = IN_MODIFY | IN_CREATE | IN_DELETE;
+			if (snapshot == nullptr && _options.backend != Backend::NATIVE) return;
 
-		const static std::size_t event_size = (sizeof(struct inotify_event));
-#endif // __unix__
+			watch_tree(root, std::string(), false, parsed_information, snapshot);
+		}
 
-		void init()
+		void monitor_directory()
 		{
-#ifdef _WIN32
-			_close_event = CreateEvent(nullptr, true, false, nullptr);
-			if (!_close_event) 
-				throw std::system_error(GetLastError(), std::system_category());
-#endif // WIN32
-			_callback_thread = std::move(std::thread([this]() {
-				try 
+			std::vector<char> buffer(_buffer_size);
+			EventBatch parsed_information;
+
+			_running.set_value();
+
+			std::array<pollfd, 2> descriptors{};
+			const int notify = _options.backend == Backend::NATIVE ? _inotify : _fanotify;
+			descriptors[0] = { notify, POLLIN, 0 };
+			descriptors[1] = { _wake_event, POLLIN, 0 };
+
+			while (_destroy == false)
+			{
+				// roots added or removed since, the initial ones included
+				parsed_information.clear();
+				parsed_information.set_captured(Clock::now());
+				apply_commands(parsed_information);
+				collect_walks(parsed_information);
+				if (!parsed_information.empty())
+					hand_over(parsed_information);
+
+				const int ready = poll(descriptors.data(), descriptors.size(), _pending_move.active ? _move_timeout_ms : -1);
+				if (ready < 0)
 				{
-					callback_thread();
+					if (errno == EINTR) continue;
+					throw std::system_error(errno, std::system_category());
 				}
-				catch (...) 
+
+				// nothing came to complete the rename
+				if (ready == 0)
 				{
-					try 
-					{
-						_running.set_exception(std::current_exception());
-					}
-					catch (...) {} // set_exception() may throw too
+					parsed_information.clear();
+					parsed_information.set_captured(Clock::now());
+					flush_pending_move(parsed_information);
+					if (!parsed_information.empty())
+						hand_over(parsed_information);
+					continue;
 				}
-			}));
 
-			_watch_thread = std::move(std::thread([this]() {
-				try 
+				// commands or destroy(), both are picked up at the top of the loop
+				if (descriptors[1].revents & POLLIN)
 				{
-					monitor_directory();
+					std::uint64_t wake = 0;
+					if (read(_wake_event, &wake, sizeof(wake)) < 0) {} // EAGAIN, someone else reset it already
+					continue;
 				}
-				catch (...) 
+
+				if ((descriptors[0].revents & POLLIN) == 0) continue;
+
+				while (_destroy == false)
 				{
-					try {
-						_running.set_exception(std::current_exception());
-					}
-					catch (...) {} // set_exception() may throw too
-				}
-			}));
+					const auto length = read(notify, static_cast<void*>(buffer.data()), buffer.size());
+					if (length <= 0) break; // EAGAIN, the kernel queue is drained
+
+					parsed_information.clear();
+					parsed_information.set_captured(Clock::now());
+					if (_walking > 0)
+						apply_armed(); // whatever this read reports on was armed before it returned
+#ifdef FILEWATCH_FANOTIFY
+					if (_options.backend == Backend::FANOTIFY)
+						parse_fanotify(buffer.data(), static_cast<std::size_t>(length), parsed_information);
+					else
+#endif // FILEWATCH_FANOTIFY
+						parse_events(buffer.data(), static_cast<std::size_t>(length), parsed_information);
 
-			std::future<void> future = _running.get_future();
-			future.get(); //block until the monitor_directory is up and running
+					//dispatch callbacks
+					if (!parsed_information.empty())
+						hand_over(parsed_information);
+				}
+			}
 		}
 
-		void destroy()
+#ifdef FILEWATCH_FANOTIFY
+		// Maps a reported directory handle to the root it is under, the answer is cached either way since a filesystem
+		// mark reports every directory on the filesystem, most of which belong to no root at all.
+		// Returns nullptr when the directory can't be opened anymore.
+		const HandlePath* resolve_directory(const struct fanotify_event_info_fid& information, const struct file_handle& handle)
 		{
-			_destroy = true;
-			_running = std::promise<void>();
-#ifdef _WIN32
-			SetEvent(_close_event);
-#elif __unix__
-			inotify_rm_watch(_directory.folder, _directory.watch);
-#endif // __unix__
-			_cv.notify_all();
-			_watch_thread.join();
-			_callback_thread.join();
-#ifdef _WIN32
-			CloseHandle(_directory);
-#elif __unix__
-			close(_directory.folder);
-#endif // __unix__
+			_handle_key.assign(reinterpret_cast<const char*>(&information.fsid), sizeof(information.fsid));
+			_handle_key.append(reinterpret_cast<const char*>(&handle.handle_type), sizeof(handle.handle_type));
+			_handle_key.append(reinterpret_cast<const char*>(handle.f_handle), handle.handle_bytes);
+
+			const auto found = _handle_paths.find(_handle_key);
+			if (found != _handle_paths.end()) return &found->second;
+
+			std::uint64_t fsid = 0;
+			std::memcpy(&fsid, &information.fsid, sizeof(fsid));
+			const auto root = std::find_if(_roots.begin(), _roots.end(), [fsid](const std::unique_ptr<Root>& candidate) { return candidate->fsid == fsid; });
+			if (root == _roots.end()) return nullptr;
+
+			_handle_buffer.resize(sizeof(struct file_handle) + handle.handle_bytes);
+			std::memcpy(_handle_buffer.data(), &handle, _handle_buffer.size());
+			const int directory = open_by_handle_at((*root)->mount, reinterpret_cast<struct file_handle*>(_handle_buffer.data()), O_PATH | O_CLOEXEC);
+			if (directory < 0) return nullptr;
+
+			char link[32];
+			std::snprintf(link, sizeof(link), "/proc/self/fd/%d", directory);
+			char target[PATH_MAX];
+			const ssize_t length = readlink(link, target, sizeof(target) - 1);
+			close(directory);
+			if (length <= 0) return nullptr;
+
+			std::string path(target, static_cast<std::size_t>(length));
+			const std::string_view deleted = " (deleted)";
+			if (path.size() >= deleted.size() && path.compare(path.size() - deleted.size(), deleted.size(), deleted) == 0) return nullptr;
+			path.push_back('/');
+
+			if (_handle_paths.size() >= _max_handle_paths)
+				_handle_paths.clear();
+
+			HandlePath& resolved = _handle_paths[_handle_key];
+			for (const auto& candidate : _roots)
+			{
+				if (path.compare(0, candidate->canonical.size(), candidate->canonical) != 0) continue;
+
+				resolved.root = candidate.get();
+				resolved.path = path.substr(candidate->canonical.size());
+				break;
+			}
+			return &resolved;
 		}
 
-		const PathParts split_directory_and_file(const std::string& path) const
+		// builds the path of a plain event in parsed_information and commits it unless the filter rejects it
+		void commit_event(Root& root, const std::string_view directory, const std::string_view name, const Event type, EventBatch& parsed_information)
 		{
-			const auto predict = [](typename std::string::value_type character) {
-#ifdef _WIN32
-				return character == _T('\\') || character == _T('/');
-#elif __unix__
-				return character == '/';
-#endif // __unix__
-			};
-#ifdef _WIN32
-#define _UNICODE
-			const std::string this_directory = _T("./");
-#elif __unix__
-			const std::string this_directory = "./";
-#endif // __unix__
-
-			const std::string::const_iterator pivot = std::find_if(path.rbegin(), path.rend(), predict).base();
-			//if the path is something like "test.txt" there will be no directoy part, however we still need one, so insert './'
-			const std::string extracted_directory = std::string(path.begin(), pivot);
-			std::string directory = (extracted_directory.size() > 0) ? extracted_directory : this_directory;
-
-			const std::string filename = std::string(pivot, path.end());
-			return PathParts(directory, filename);
+			parsed_information.set_root(root.id);
+			parsed_information.begin();
+			parsed_information.append(directory);
+			parsed_information.append(name);
+			track_state(root, parsed_information.pending(), type);
+
+			if (pass_filter(root, parsed_information.pending()))
+				parsed_information.commit(type);
+			else
+				parsed_information.rollback();
 		}
 
-		bool pass_filter(const std::string& file_path)
+		// A FAN_RENAME, the old and the new name in one event: a rename when both are in the same root, a deletion
+		// and a creation when they are in different ones, just one of those when the other side is in no root at all
+		void commit_fanotify_rename(const struct fanotify_event_info_fid& old_information, const struct fanotify_event_info_fid& new_information,
+			const bool is_directory, EventBatch& parsed_information)
 		{
-			if (_watching_single_file) 
+			const struct file_handle* old_handle = reinterpret_cast<const struct file_handle*>(old_information.handle);
+			const struct file_handle* new_handle = reinterpret_cast<const struct file_handle*>(new_information.handle);
+			const std::string_view old_name(reinterpret_cast<const char*>(old_handle->f_handle + old_handle->handle_bytes));
+			const std::string_view new_name(reinterpret_cast<const char*>(new_handle->f_handle + new_handle->handle_bytes));
+
+			// resolving the new side may drop the cache the old one was found in
+			const HandlePath* directory = resolve_directory(old_information, *old_handle);
+			Root* old_root = directory == nullptr ? nullptr : directory->root;
+			if (old_root != nullptr)
+				_rename_directory = directory->path;
+			directory = resolve_directory(new_information, *new_handle);
+			Root* new_root = directory == nullptr ? nullptr : directory->root;
+			if (new_root != nullptr)
+				_handle_directory = directory->path;
+
+			// a directory changing place takes every cached path under it along
+			if (is_directory)
+				_handle_paths.clear();
+
+			// a single file root only cares about the directory it is in
+			if (old_root != nullptr && (old_name.empty() || (old_root->watching_single_file && !_rename_directory.empty())))
+				old_root = nullptr;
+			if (new_root != nullptr && (new_name.empty() || (new_root->watching_single_file && !_handle_directory.empty())))
+				new_root = nullptr;
+
+			if (old_root != nullptr && old_root == new_root)
 			{
-				const std::string extracted_filename = { split_directory_and_file(file_path).filename };
-				//if we are watching a single file, only that file should trigger action
-				return extracted_filename == _filename;
+				parsed_information.set_root(new_root->id);
+				parsed_information.begin();
+				parsed_information.append(_rename_directory);
+				parsed_information.append(old_name);
+				parsed_information.split();
+				parsed_information.append(_handle_directory);
+				parsed_information.append(new_name);
+				commit_rename(*new_root, parsed_information);
+				return;
 			}
 
-			return true;
-		}
-
-#ifdef _WIN32
-		HANDLE get_directory(const std::string& path)
-		{
-			DWORD file_info = GetFileAttributes(path.c_str());
-			if (file_info == INVALID_FILE_ATTRIBUTES)
-				throw std::system_error(GetLastError(), std::system_category());
+			if (old_root != nullptr)
+				commit_event(*old_root, _rename_directory, old_name, Event::DELETED, parsed_information);
 
-			std::string watch_path;
-			_watching_single_file = (file_info & FILE_ATTRIBUTE_DIRECTORY) == false;
-			if (_watching_single_file)
-			{
-				const auto parsed_path = split_directory_and_file(path);
-				_filename = parsed_path.filename;
-				watch_path = parsed_path.directory;
-			}
-			else
+			// moved in from outside the root, what came along with a directory is as good as new
+			if (new_root != nullptr)
 			{
-				watch_path = path;
+				commit_event(*new_root, _handle_directory, new_name, Event::CREATED, parsed_information);
+				if (is_directory && !new_root->watching_single_file)
+					watch_tree(*new_root, _handle_directory + std::string(new_name) + "/", true, parsed_information, _options.resync ? &new_root->snapshot : nullptr);
 			}
-
-			HANDLE directory = CreateFile(
-				watch_path.c_str(),                                     // pointer to the file name
-				FILE_LIST_DIRECTORY,                                    // access (read/write) mode
-				FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, // share mode
-				nullptr,                                                // security descriptor
-				OPEN_EXISTING,                                          // how to create
-				FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,      // file attributes
-				nullptr);                                               // file with attributes to copy
-
-			if (directory == INVALID_HANDLE_VALUE)
-				throw std::system_error(GetLastError(), std::system_category());
-
-			return directory;
 		}
 
-		std::string unicode_to_string(const std::wstring& unicode_string)
+		// Events come with the handle of the directory they happened in and the entry's name. The kernel merges
+		// events on the same entry into one mask and keeps no order between them. Where an entry both appeared and
+		// went away, whether it is on disk now tells which came last: a delete and recreate (an atomic save) must not
+		// end in DELETED, nor a short lived temporary file in CREATED.
+		// The halves of a rename have no cookie to pair them up by, FAN_RENAME is what tells renames.
+		void parse_fanotify(const char* buffer, const std::size_t length, EventBatch& parsed_information)
 		{
-			int unicode_len = (int)unicode_string.length() + 1;
-			int len = WideCharToMultiByte(CP_ACP, 0, unicode_string.c_str(), unicode_len, 0, 0, 0, 0);
-			char* buffer = new char[len];
-			WideCharToMultiByte(CP_ACP, 0, unicode_string.c_str(), unicode_len, buffer, len, 0, 0);
-			std::string translated_string(buffer);
-			delete[] buffer;
-
-			return translated_string;
-		}
+			long remaining = static_cast<long>(length);
+			for (const struct fanotify_event_metadata* metadata = reinterpret_cast<const struct fanotify_event_metadata*>(buffer);
+				FAN_EVENT_OK(metadata, remaining);
+				metadata = FAN_EVENT_NEXT(metadata, remaining))
+			{
+				// never set with FAN_REPORT_DFID_NAME, but a leaked descriptor would be worse than the check
+				if (metadata->fd >= 0)
+					close(metadata->fd);
 
-		void monitor_directory()
-		{
-			std::vector<BYTE> buffer(_buffer_size);
-			DWORD bytes_returned = 0;
-			OVERLAPPED overlapped_buffer{ 0 };
+				// the kernel queue ran full and events were thrown away, every root may have lost some
+				if (metadata->mask & FAN_Q_OVERFLOW)
+				{
+					for (auto& root : _roots)
+						resync(*root, parsed_information);
+					continue;
+				}
 
-			overlapped_buffer.hEvent = CreateEvent(nullptr, true, false, nullptr);
-			if (!overlapped_buffer.hEvent) 
-				std::cerr << "Error creating monitor event" << std::endl;
+				const struct fanotify_event_info_fid* information = nullptr;
+#ifdef FAN_RENAME
+				const struct fanotify_event_info_fid* old_information = nullptr; // the two sides of a FAN_RENAME
+				const struct fanotify_event_info_fid* new_information = nullptr;
+#endif // FAN_RENAME
+				const char* record = reinterpret_cast<const char*>(metadata) + metadata->metadata_len;
+				const char* end = reinterpret_cast<const char*>(metadata) + metadata->event_len;
+				while (record + sizeof(struct fanotify_event_info_header) <= end)
+				{
+					const struct fanotify_event_info_header* header = reinterpret_cast<const struct fanotify_event_info_header*>(record);
+					if (header->len == 0) break;
+					if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+						information = reinterpret_cast<const struct fanotify_event_info_fid*>(record);
+#ifdef FAN_RENAME
+					else if (header->info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME)
+						old_information = reinterpret_cast<const struct fanotify_event_info_fid*>(record);
+					else if (header->info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME)
+						new_information = reinterpret_cast<const struct fanotify_event_info_fid*>(record);
+#endif // FAN_RENAME
+					record += header->len;
+				}
 
-			std::array<HANDLE, 2> handles{ overlapped_buffer.hEvent, _close_event };
+				const bool is_directory = (metadata->mask & FAN_ONDIR) != 0;
+#ifdef FAN_RENAME
+				// never merged with other events, the kernel keeps renames to themselves
+				if (metadata->mask & FAN_RENAME)
+				{
+					if (old_information != nullptr && new_information != nullptr)
+						commit_fanotify_rename(*old_information, *new_information, is_directory, parsed_information);
+					continue;
+				}
+#endif // FAN_RENAME
 
-			bool async_pending = false;
-			_running.set_value();
-			do 
-			{
-				std::vector<std::pair<std::string, Event>> parsed_information = {};
-				ReadDirectoryChangesW(_directory, buffer.data(), buffer.size(), true, _listen_filters, &bytes_returned, &overlapped_buffer, nullptr);
+				const HandlePath* directory = nullptr;
+				const struct file_handle* handle = nullptr;
+				if (information != nullptr)
+				{
+					handle = reinterpret_cast<const struct file_handle*>(information->handle);
+					directory = resolve_directory(*information, *handle);
+				}
 
-				async_pending = true;
+				Root* root = directory == nullptr ? nullptr : directory->root;
 
-				switch (WaitForMultipleObjects(2, handles.data(), false, INFINITE))
+				// a directory changing place takes every cached path under it along
+				if (is_directory && (metadata->mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE)))
 				{
-					case WAIT_OBJECT_0:
-					{
-						if (!GetOverlappedResult(_directory, &overlapped_buffer, &bytes_returned, true)) 
-							throw std::system_error(GetLastError(), std::system_category());
+					if (root != nullptr)
+						_handle_directory = directory->path;
+					_handle_paths.clear();
+				}
+				else if (root != nullptr)
+				{
+					_handle_directory = directory->path;
+				}
 
-						async_pending = false;
+				if (root == nullptr) continue;
 
-						if (bytes_returned == 0) break;
+				const std::string_view name(reinterpret_cast<const char*>(handle->f_handle + handle->handle_bytes));
+				if (name.empty() || name == ".") continue;
 
-						FILE_NOTIFY_INFORMATION* file_information = reinterpret_cast<FILE_NOTIFY_INFORMATION*>(&buffer[0]);
-						do
-						{
-							std::wstring temp_changed_file(file_information->FileName, file_information->FileNameLength / 2);
-							std::string changed_file(temp_changed_file.size(), static_cast<typename std::string::value_type>('\0'));
-							for (size_t k = 0; k < changed_file.size(); ++k)
-								changed_file[k] = static_cast<typename std::string::value_type>(temp_changed_file[k]);
+				// a single file root only cares about the directory it is in
+				if (root->watching_single_file && !_handle_directory.empty()) continue;
 
-							if (pass_filter(changed_file))
-								parsed_information.emplace_back(std::string(changed_file), _event_type_mapping.at(file_information->Action));
+				const bool removed = (metadata->mask & (FAN_MOVED_FROM | FAN_DELETE)) != 0;
+				const bool added = (metadata->mask & (FAN_CREATE | FAN_MOVED_TO)) != 0;
+				EntryState state;
+				const bool removed_first = removed && added && stat_entry(*root, _handle_directory + std::string(name), state);
 
-							if (file_information->NextEntryOffset == 0) break;
+				if (removed_first)
+					commit_event(*root, _handle_directory, name, Event::DELETED, parsed_information);
 
-							file_information = reinterpret_cast<FILE_NOTIFY_INFORMATION*>(reinterpret_cast<BYTE*>(file_information) + file_information->NextEntryOffset);
-						} while (true);
-						break;
-					}
-					case WAIT_OBJECT_0 + 1:
-						// quit
-						break;
-					case WAIT_FAILED:
-						break;
+				if (metadata->mask & FAN_CREATE)
+					commit_event(*root, _handle_directory, name, Event::CREATED, parsed_information);
+
+				// one half of a rename, without FAN_RENAME it can't be told which other half is its own
+				if (metadata->mask & FAN_MOVED_TO)
+				{
+					// what came along with a directory is as good as new
+					commit_event(*root, _handle_directory, name, Event::CREATED, parsed_information);
+					if (is_directory && !root->watching_single_file)
+						watch_tree(*root, _handle_directory + std::string(name) + "/", true, parsed_information, _options.resync ? &root->snapshot : nullptr);
 				}
 
-				//dispatch callbacks
-				std::lock_guard<std::mutex> lock(_callback_mutex);
-				_callback_information.insert(_callback_information.end(), parsed_information.begin(), parsed_information.end());
-				_cv.notify_all();
-			} while (_destroy == false);
+				if (metadata->mask & FAN_MODIFY)
+					commit_event(*root, _handle_directory, name, Event::CHANGED, parsed_information);
 
-			if (async_pending)
-			{
-				//clean up running async io
-				CancelIo(_directory);
-				GetOverlappedResult(_directory, &overlapped_buffer, &bytes_returned, true);
+				if (removed && !removed_first)
+					commit_event(*root, _handle_directory, name, Event::DELETED, parsed_information);
 			}
 		}
-#endif // WIN32
+#endif // FILEWATCH_FANOTIFY
 
-#if __unix__
-
-		bool is_file(const std::string& path) const
+		// the IN_MOVED_FROM never got its IN_MOVED_TO, so the entry was moved somewhere outside its root
+		void flush_pending_move(EventBatch& parsed_information)
 		{
-			struct stat statbuf = {};
-			if (stat(path.c_str(), &statbuf) != 0)
-				throw std::system_error(errno, std::system_category());
+			if (!_pending_move.active) return;
+
+			_pending_move.active = false;
+			Root& root = *_pending_move.root;
+			parsed_information.set_root(root.id);
+			track_state(root, _pending_move.path, Event::DELETED);
+			if (_pending_move.directory)
+				forget_watches(root, _pending_move.path + "/");
 
-			return S_ISREG(statbuf.st_mode);
+			if (pass_filter(root, _pending_move.path))
+				parsed_information.emplace_back(_pending_move.path, Event::DELETED);
 		}
 
-		FolderInfo get_directory(const std::string& path)
+		void parse_events(const char* buffer, const std::size_t length, EventBatch& parsed_information)
 		{
-			const int folder = inotify_init();
-			if (folder < 0)
-				throw std::system_error(errno, std::system_category());
+			std::size_t i = 0;
+			while (i < length)
+			{
+				const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(&buffer[i]); // NOLINT
+				i += event_size + event->len;
 
-			_watching_single_file = is_file(path);
+				// the kernel queue ran full and events were thrown away, it is shared so every root lost some
+				if (event->mask & IN_Q_OVERFLOW)
+				{
+					flush_pending_move(parsed_information);
+					for (auto& root : _roots)
+						resync(*root, parsed_information);
+					continue;
+				}
 
-			std::string watch_path;
-			{
-				if (_watching_single_file)
+				auto found = _watches.find(event->wd);
+
+				// moves within a root are reported back to back, anything else in between means the entry left it
+				if (_pending_move.active && ((event->mask & IN_MOVED_TO) == 0 || event->cookie != _pending_move.cookie || found == _watches.end() || found->second.root != _pending_move.root))
 				{
-					const filewatch::FileWatch::PathParts parsed_path = split_directory_and_file(path);
-					_filename = parsed_path.filename;
-					watch_path = parsed_path.directory;
+					flush_pending_move(parsed_information);
+					found = _watches.find(event->wd); // the watches of a directory that left went with it
 				}
-				else
+
+				if (found == _watches.end()) continue;
+
+				const WatchEntry& watch = found->second;
+				Root& root = *watch.root;
+				parsed_information.set_root(root.id);
+
+				if (event->mask & (IN_DELETE_SELF | IN_IGNORED))
+				{
+					drop_watch(event->wd);
+					continue;
+				}
+
+				if (event->len && (event->mask & IN_MOVED_FROM))
+				{
+					_pending_move.active = true;
+					_pending_move.cookie = event->cookie;
+					_pending_move.directory = (event->mask & IN_ISDIR) != 0;
+					_pending_move.root = &root;
+					_pending_move.path.assign(watch.path).append(event->name);
+					continue;
+				}
+
+				if (event->len && (event->mask & IN_MOVED_TO) && _pending_move.active)
+				{
+					parsed_information.begin();
+					parsed_information.append(_pending_move.path);
+					parsed_information.split();
+					parsed_information.append(watch.path);
+					parsed_information.append(std::string_view(event->name));
+
+					if (_pending_move.directory)
+						rename_watches(root, _pending_move.path + "/", std::string(parsed_information.pending()) + "/");
+
+					commit_rename(root, parsed_information);
+					_pending_move.active = false;
+					continue;
+				}
+
+				if (event->len)
 				{
-					watch_path = path;
+					// the path is assembled in place inside the batch, filtered out events are rolled back again
+					parsed_information.begin();
+					parsed_information.append(watch.path);
+					parsed_information.append(std::string_view(event->name));
+
+					// whatever is moved in from outside the root is as good as new
+					const bool created_directory = (event->mask & (IN_CREATE | IN_MOVED_TO)) && (event->mask & IN_ISDIR) && !root.watching_single_file;
+					const std::string relative_directory = created_directory ? std::string(parsed_information.pending()) + "/" : std::string();
+
+					bool known_event = true;
+					Event type = Event::CHANGED;
+					if (event->mask & (IN_CREATE | IN_MOVED_TO))
+						type = Event::CREATED;
+					else if (event->mask & IN_DELETE)
+						type = Event::DELETED;
+					else if (event->mask & IN_MODIFY)
+						type = Event::CHANGED;
+					else
+						known_event = false;
+
+					if (known_event)
+						track_state(root, parsed_information.pending(), type);
+
+					if (known_event && pass_filter(root, parsed_information.pending()))
+						parsed_information.commit(type);
+					else
+						parsed_information.rollback();
+
+					// add_watch() changes _watches, watch is not to be used past this point
+					if (created_directory && add_watch(root, relative_directory))
+						watch_tree(root, relative_directory, true, parsed_information, _options.resync ? &root.snapshot : nullptr);
 				}
 			}
+		}
+#endif // __unix__
 
-			const auto watch = inotify_add_watch(folder, watch_path.c_str(), IN_MODIFY | IN_CREATE | IN_DELETE);
-			if (watch < 0)
-				throw std::system_error(errno, std::system_category());
+		// moves a parsed batch over to the callback thread (or straight into the callback), parsed_information comes back empty
+		void hand_over(EventBatch& parsed_information)
+		{
+			if (_options.delivery == Delivery::DIRECT)
+			{
+				deliver(parsed_information);
+				parsed_information.clear();
+				return;
+			}
 
-			return { folder, watch };
+			std::unique_lock<std::mutex> lock(_callback_mutex);
+			if (_options.queue_capacity > 0)
+				make_room(lock, parsed_information);
+
+			if (_callback_information.empty())
+				_callback_information.swap(parsed_information);
+			else
+				_callback_information.append(parsed_information);
+
+			parsed_information.clear();
+			_cv.notify_all();
 		}
 
-		void monitor_directory()
+		// applies Options::queue_policy when parsed_information doesn't fit behind what is queued, _callback_mutex is held
+		void make_room(std::unique_lock<std::mutex>& lock, EventBatch& parsed_information)
 		{
-			std::vector<char> buffer(_buffer_size);
+			const std::size_t capacity = _options.queue_capacity;
+			if (_callback_information.size() + parsed_information.size() <= capacity) return;
 
-			_running.set_value();
-			while (_destroy == false)
+			switch (_options.queue_policy)
 			{
-				const auto length = read(_directory.folder, static_cast<void*>(buffer.data()), buffer.size());
-				if (length > 0)
+				case QueuePolicy::BLOCK:
+					// a batch larger than the whole queue still goes through once the queue is empty
+					++_drop_counts.blocked;
+					_space_cv.wait(lock, [this, &parsed_information, capacity] {
+						return _destroy || _callback_information.empty() || _callback_information.size() + parsed_information.size() <= capacity;
+					});
+					break;
+				case QueuePolicy::DROP_OLDEST:
 				{
-					int i = 0;
-					std::vector<std::pair<std::string, Event>> parsed_information;
-					while (i < length)
+					const std::size_t excess = _callback_information.size() + parsed_information.size() - capacity;
+					const std::size_t queued = std::min(excess, _callback_information.size());
+					_callback_information.drop_front(queued);
+					parsed_information.drop_front(excess - queued);
+					_drop_counts.dropped += excess;
+					break;
+				}
+				case QueuePolicy::DROP_NEWEST:
+				case QueuePolicy::COLLAPSE:
+				{
+					const std::size_t room = capacity - std::min(capacity, _callback_information.size());
+					if (_options.queue_policy == QueuePolicy::COLLAPSE)
 					{
-						struct inotify_event* event = reinterpret_cast<struct inotify_event*>(&buffer[i]); // NOLINT
-						if (event->len)
-						{
-							const std::string changed_file(event->name);
-							if (pass_filter(changed_file))
-							{
-								if (event->mask & IN_CREATE)
-									parsed_information.emplace_back(std::string(changed_file), Event::CREATED);
-								else if (event->mask & IN_DELETE)
-									parsed_information.emplace_back(std::string(changed_file), Event::DELETED);
-								else if (event->mask & IN_MODIFY)
-									parsed_information.emplace_back(std::string(changed_file), Event::CHANGED);
-							}
-						}
-						i += event_size + event->len;
+						std::size_t index = 0;
+						parsed_information.for_each([this, &index, room](const FileEvent& event) {
+							if (index++ < room) return;
+
+							_dirty.emplace(event.root, std::string(PathFilter::directory_name(event.path)));
+							if (!event.old_path.empty())
+								_dirty.emplace(event.root, std::string(PathFilter::directory_name(event.old_path)));
+							++_drop_counts.collapsed;
+						});
+					}
+					else
+					{
+						_drop_counts.dropped += parsed_information.size() - room;
 					}
 
-					//dispatch callbacks
-					std::lock_guard<std::mutex> lock(_callback_mutex);
-					_callback_information.insert(_callback_information.end(), parsed_information.begin(), parsed_information.end());
-					_cv.notify_all();
+					parsed_information.truncate(room);
+					break;
 				}
 			}
 		}
-#endif // __unix__
 
 		void callback_thread()
 		{
-			while (_destroy == false) 
+			EventBatch callback_information;
+			while (_destroy == false)
 			{
 				std::unique_lock<std::mutex> lock(_callback_mutex);
-				if (_callback_information.empty() && _destroy == false) 
+				if (_callback_information.empty() && _destroy == false)
 					_cv.wait(lock, [this] { return _callback_information.size() > 0 || _destroy; });
 
-				std::vector<std::pair<std::string, Event>> callback_information = {};
-				std::swap(callback_information, _callback_information);
+				callback_information.swap(_callback_information);
+				callback_information.set_captured(Clock::now());
+				for (const auto& directory : _dirty)
+				{
+					callback_information.set_root(directory.first);
+					callback_information.emplace_back(directory.second, Event::DIRTY);
+				}
+				_dirty.clear();
 				lock.unlock();
+				_space_cv.notify_all();
 
-				for (const auto& file : callback_information)
-				{
-					if (!_callback) continue;
+				deliver(callback_information);
+				callback_information.clear();
+			}
+		}
 
-					try
-					{
-						_callback(file.first, file.second);
-					}
-					catch (const std::exception&)
-					{
-					}
-				}
+		void deliver(const EventBatch& events)
+		{
+			if constexpr (std::is_constructible_v<bool, const Sink&>)
+			{
+				if (!_callback) return;
 			}
+
+			events.for_each([this](const FileEvent& event) {
+				try
+				{
+					_callback(event);
+				}
+				catch (const std::exception&)
+				{
+				}
+			});
 		}
 	};
+
+	using FileWatch = BasicFileWatch<>;
 }
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,127 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace filewatch {
+	// Log-linear histogram of durations, the bucket layout HdrHistogram uses: microsecond values below 32 get a bucket
+	// each, above that every power of two is split into 16 buckets, which keeps every recorded value within about 3%
+	// of where its bucket reports it, from a microsecond up to months, in 5KB.
+	// record() is lock free and can be called from any number of threads, readers see a consistent enough picture
+	// without stopping them.
+	class LatencyHistogram
+	{
+	public:
+		struct Summary
+		{
+			std::uint64_t count = 0;
+			double mean = 0; // all in seconds
+			double p50 = 0;
+			double p90 = 0;
+			double p99 = 0;
+			double max = 0;
+		};
+
+		void record(const std::chrono::steady_clock::duration duration)
+		{
+			const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+			const std::uint64_t value = micros > 0 ? static_cast<std::uint64_t>(micros) : 0;
+
+			_buckets[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+			_count.fetch_add(1, std::memory_order_relaxed);
+			_sum.fetch_add(value, std::memory_order_relaxed);
+
+			std::uint64_t max = _max.load(std::memory_order_relaxed);
+			while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+		}
+
+		Summary summary() const
+		{
+			Summary summary;
+			summary.count = _count.load(std::memory_order_relaxed);
+			if (summary.count == 0) return summary;
+
+			summary.mean = static_cast<double>(_sum.load(std::memory_order_relaxed)) / static_cast<double>(summary.count) / 1e6;
+			summary.max = static_cast<double>(_max.load(std::memory_order_relaxed)) / 1e6;
+			summary.p50 = std::min(percentile(0.50, summary.count), summary.max);
+			summary.p90 = std::min(percentile(0.90, summary.count), summary.max);
+			summary.p99 = std::min(percentile(0.99, summary.count), summary.max);
+			return summary;
+		}
+
+		void reset()
+		{
+			for (std::atomic<std::uint64_t>& bucket : _buckets)
+				bucket.store(0, std::memory_order_relaxed);
+			_count.store(0, std::memory_order_relaxed);
+			_sum.store(0, std::memory_order_relaxed);
+			_max.store(0, std::memory_order_relaxed);
+		}
+
+	private:
+		static constexpr int _linear_bits = 5;                    // values below 2^5 are exact
+		static constexpr int _sub_buckets = 1 << (_linear_bits - 1); // buckets per power of two above that
+		static constexpr int _highest_bit = 42;                    // about 100 days in microseconds, longer is clamped
+		static constexpr std::size_t _bucket_count = (_highest_bit - _linear_bits + 3) * _sub_buckets;
+
+		static int highest_bit(std::uint64_t value)
+		{
+			int bit = 0;
+			for (int step = 32; step > 0; step /= 2)
+			{
+				if (value >> step)
+				{
+					value >>= step;
+					bit += step;
+				}
+			}
+			return bit;
+		}
+
+		static std::size_t bucket_of(std::uint64_t value)
+		{
+			if (value < (1u << _linear_bits)) return static_cast<std::size_t>(value);
+
+			const std::uint64_t top = (std::uint64_t(1) << (_highest_bit + 1)) - 1;
+			if (value > top) value = top;
+
+			// the bits below the highest _linear_bits ones are what the bucket doesn't tell apart
+			const int shift = highest_bit(value) - (_linear_bits - 1);
+			return static_cast<std::size_t>(shift) * _sub_buckets + static_cast<std::size_t>(value >> shift);
+		}
+
+		// the middle of the bucket, in microseconds
+		static double bucket_value(const std::size_t bucket)
+		{
+			if (bucket < (1u << _linear_bits)) return static_cast<double>(bucket);
+
+			const int shift = static_cast<int>(bucket / _sub_buckets) - 1;
+			const std::uint64_t lowest = static_cast<std::uint64_t>(bucket % _sub_buckets + _sub_buckets) << shift;
+			return static_cast<double>(lowest) + static_cast<double>((std::uint64_t(1) << shift) - 1) / 2;
+		}
+
+		double percentile(const double fraction, const std::uint64_t count) const
+		{
+			const std::uint64_t wanted = static_cast<std::uint64_t>(fraction * static_cast<double>(count - 1)) + 1;
+			std::uint64_t seen = 0;
+			for (std::size_t bucket = 0; bucket < _bucket_count; ++bucket)
+			{
+				seen += _buckets[bucket].load(std::memory_order_relaxed);
+				if (seen >= wanted) return bucket_value(bucket) / 1e6;
+			}
+
+			return static_cast<double>(_max.load(std::memory_order_relaxed)) / 1e6;
+		}
+
+		std::array<std::atomic<std::uint64_t>, _bucket_count> _buckets{};
+		std::atomic<std::uint64_t> _count{0};
+		std::atomic<std::uint64_t> _sum{0};
+		std::atomic<std::uint64_t> _max{0};
+	};
+}
+#endif
@@ -0,0 +1,160 @@
+#ifndef PARALLEL_WALKER_H
+#define PARALLEL_WALKER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace filewatch {
+	// Walks a directory tree on several threads at once. Every worker takes directories off the back of its own queue,
+	// staying deep in the subtree it is in, and once that runs dry steals from the front of another worker's queue,
+	// where the directories closest to the top, and so the largest unexplored subtrees, are.
+	//
+	// visit(worker, directory, subdirectories) lists one directory and appends the ones to descend into. It runs on
+	// every worker concurrently, worker (below the worker count) lets it keep per thread state without locking.
+	// done() is called once from the last worker to finish, unless the walk was cancelled.
+	class ParallelWalker
+	{
+	public:
+		using Visit = std::function<void(std::size_t worker, const std::string& directory, std::vector<std::string>& subdirectories)>;
+		using Done = std::function<void()>;
+
+		// the recommended worker count when nothing else asks for one, a walk mostly waits on the disk and the kernel
+		static std::size_t default_workers()
+		{
+			const unsigned int cores = std::thread::hardware_concurrency();
+			return cores == 0 ? 2 : std::min<std::size_t>(cores, 8);
+		}
+
+		// starts walking from root right away
+		ParallelWalker(std::string root, const std::size_t workers, Visit visit, Done done) :
+			_visit(std::move(visit)),
+			_done(std::move(done)),
+			_queues(workers == 0 ? 1 : workers)
+		{
+			_queues[0].directories.push_back(std::move(root));
+			_outstanding = 1;
+
+			for (std::size_t worker = 0; worker < _queues.size(); ++worker)
+				_threads.emplace_back([this, worker]() { work(worker); });
+		}
+
+		~ParallelWalker()
+		{
+			cancel();
+			wait();
+		}
+
+		ParallelWalker(const ParallelWalker&) = delete;
+		ParallelWalker& operator=(const ParallelWalker&) = delete;
+
+		// workers stop after the directory they are in
+		void cancel()
+		{
+			_cancelled = true;
+		}
+
+		// blocks until every worker is done, the walk completing or being cancelled
+		void wait()
+		{
+			for (std::thread& thread : _threads)
+			{
+				if (thread.joinable())
+					thread.join();
+			}
+		}
+
+		std::size_t workers() const
+		{
+			return _queues.size();
+		}
+
+	private:
+		struct Queue
+		{
+			std::mutex mutex;
+			std::deque<std::string> directories;
+		};
+
+		bool take(const std::size_t worker, std::string& directory)
+		{
+			{
+				Queue& own = _queues[worker];
+				std::lock_guard<std::mutex> lock(own.mutex);
+				if (!own.directories.empty())
+				{
+					directory = std::move(own.directories.back());
+					own.directories.pop_back();
+					return true;
+				}
+			}
+
+			for (std::size_t offset = 1; offset < _queues.size(); ++offset)
+			{
+				Queue& victim = _queues[(worker + offset) % _queues.size()];
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				if (!victim.directories.empty())
+				{
+					directory = std::move(victim.directories.front());
+					victim.directories.pop_front();
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		void work(const std::size_t worker)
+		{
+			std::string directory;
+			std::vector<std::string> subdirectories;
+			int idle = 0;
+			while (!_cancelled && _outstanding > 0)
+			{
+				if (!take(worker, directory))
+				{
+					// whoever is still listing a directory may hand out more, a large one can take a while
+					if (++idle < 64)
+						std::this_thread::yield();
+					else
+						std::this_thread::sleep_for(std::chrono::microseconds(200));
+					continue;
+				}
+
+				idle = 0;
+				_visit(worker, directory, subdirectories);
+				if (!subdirectories.empty())
+				{
+					// counted before they can be stolen, so _outstanding never drops to zero with work left
+					_outstanding += subdirectories.size();
+					Queue& own = _queues[worker];
+					std::lock_guard<std::mutex> lock(own.mutex);
+					for (std::string& subdirectory : subdirectories)
+						own.directories.push_back(std::move(subdirectory));
+				}
+				subdirectories.clear();
+				--_outstanding;
+			}
+
+			if (++_finished == _queues.size() && !_cancelled && _done)
+				_done();
+		}
+
+		const Visit _visit;
+		const Done _done;
+		std::vector<Queue> _queues;
+		std::vector<std::thread> _threads;
+		std::atomic<std::size_t> _outstanding{0}; // directories queued or being listed
+		std::atomic<std::size_t> _finished{0};    // workers that returned
+		std::atomic_bool _cancelled{false};
+	};
+}
+#endif
@@ -0,0 +1,200 @@
+#ifndef PATH_FILTER_H
+#define PATH_FILTER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+
+namespace filewatch {
+	// Include/exclude glob matcher for paths relative to the watched root.
+	//
+	// Pattern syntax:
+	//   *   any run of characters inside a single path component
+	//   **  any run of characters, across components ("lua/**/*.lua" also matches "lua/init.lua")
+	//   ?   any single character except a separator
+	// Patterns without a '/' are matched against the file name only, so "*.lua" matches lua files at any depth.
+	// Both '/' and '\' count as separators on either side, which lets the same patterns run on raw Windows paths.
+	//
+	// A path passes when it matches at least one include pattern (or there are none) and no exclude pattern.
+	class PathFilter
+	{
+	public:
+		PathFilter() = default;
+
+		PathFilter(const std::vector<std::string>& include, const std::vector<std::string>& exclude)
+		{
+			for (const std::string& pattern : include)
+				_include.push_back(compile(pattern));
+
+			for (const std::string& pattern : exclude)
+				_exclude.push_back(compile(pattern));
+		}
+
+		bool passes(const std::string_view path) const
+		{
+			for (const Pattern& pattern : _exclude)
+				if (pattern.matches(path)) return false;
+
+			if (_include.empty()) return true;
+
+			for (const Pattern& pattern : _include)
+				if (pattern.matches(path)) return true;
+
+			return false;
+		}
+
+		bool empty() const
+		{
+			return _include.empty() && _exclude.empty();
+		}
+
+		static bool is_separator(const char character)
+		{
+			return character == '/' || character == '\\';
+		}
+
+		static std::string_view file_name(const std::string_view path)
+		{
+			for (std::size_t i = path.size(); i > 0; --i)
+				if (is_separator(path[i - 1])) return path.substr(i);
+
+			return path;
+		}
+
+		// everything before the file name, without the separator, empty for entries at the top of the root
+		static std::string_view directory_name(const std::string_view path)
+		{
+			for (std::size_t i = path.size(); i > 0; --i)
+				if (is_separator(path[i - 1])) return path.substr(0, i - 1);
+
+			return std::string_view();
+		}
+
+		static bool glob_match(const std::string_view pattern, const std::string_view path)
+		{
+			std::size_t p = 0;
+			std::size_t s = 0;
+			while (p < pattern.size())
+			{
+				if (pattern[p] == '*')
+				{
+					if (p + 1 < pattern.size() && pattern[p + 1] == '*')
+					{
+						const std::size_t rest = p + 2;
+						// "**/" may also stand for no directory at all
+						if (rest < pattern.size() && is_separator(pattern[rest]) && glob_match(pattern.substr(rest + 1), path.substr(s)))
+							return true;
+
+						for (std::size_t k = s; k <= path.size(); ++k)
+							if (glob_match(pattern.substr(rest), path.substr(k))) return true;
+
+						return false;
+					}
+
+					for (std::size_t k = s; ; ++k)
+					{
+						if (glob_match(pattern.substr(p + 1), path.substr(k))) return true;
+						if (k == path.size() || is_separator(path[k])) return false;
+					}
+				}
+
+				if (s == path.size()) return false;
+
+				if (pattern[p] == '?')
+				{
+					if (is_separator(path[s])) return false;
+				}
+				else if (!same_character(pattern[p], path[s]))
+				{
+					return false;
+				}
+
+				++p;
+				++s;
+			}
+
+			return s == path.size();
+		}
+
+	private:
+		enum class Kind
+		{
+			EXACT,  // no wildcards at all
+			PREFIX, // "dir/**"
+			SUFFIX, // "*.ext"
+			GLOB
+		};
+
+		struct Pattern
+		{
+			Kind kind;
+			bool name_only;
+			std::string text; // the literal part for EXACT/PREFIX/SUFFIX, the whole pattern for GLOB
+
+			bool matches(const std::string_view path) const
+			{
+				const std::string_view subject = name_only ? file_name(path) : path;
+				switch (kind)
+				{
+					case Kind::EXACT:
+						return subject.size() == text.size() && equal(subject, text);
+					case Kind::PREFIX:
+						return subject.size() >= text.size() && equal(subject.substr(0, text.size()), text);
+					case Kind::SUFFIX:
+						return subject.size() >= text.size() && equal(subject.substr(subject.size() - text.size()), text);
+					default:
+						return glob_match(text, subject);
+				}
+			}
+		};
+
+		static bool same_character(const char left, const char right)
+		{
+			if (is_separator(left) && is_separator(right)) return true;
+#ifdef _WIN32
+			const auto lower = [](char character) { return (character >= 'A' && character <= 'Z') ? static_cast<char>(character - 'A' + 'a') : character; };
+			return lower(left) == lower(right);
+#else
+			return left == right;
+#endif // _WIN32
+		}
+
+		static bool equal(const std::string_view left, const std::string_view right)
+		{
+			for (std::size_t i = 0; i < left.size(); ++i)
+				if (!same_character(left[i], right[i])) return false;
+
+			return true;
+		}
+
+		static bool has_wildcards(const std::string_view text)
+		{
+			return text.find_first_of("*?") != std::string_view::npos;
+		}
+
+		static Pattern compile(std::string pattern)
+		{
+			while (!pattern.empty() && is_separator(pattern.front()))
+				pattern.erase(pattern.begin());
+
+			const bool name_only = pattern.find_first_of("/\\") == std::string::npos;
+			const std::string_view view(pattern);
+
+			if (!has_wildcards(view))
+				return { Kind::EXACT, name_only, pattern };
+
+			if (!name_only && view.size() > 3 && view.substr(view.size() - 3) == "/**" && !has_wildcards(view.substr(0, view.size() - 3)))
+				return { Kind::PREFIX, false, pattern.substr(0, pattern.size() - 2) };
+
+			if (name_only && view.size() > 1 && view[0] == '*' && !has_wildcards(view.substr(1)))
+				return { Kind::SUFFIX, true, pattern.substr(1) };
+
+			return { Kind::GLOB, name_only, pattern };
+		}
+
+		std::vector<Pattern> _include;
+		std::vector<Pattern> _exclude;
+	};
+}
+#endif
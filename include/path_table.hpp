@@ -0,0 +1,121 @@
+#ifndef PATH_TABLE_H
+#define PATH_TABLE_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+
+namespace filewatch {
+	using PathId = std::uint32_t;
+
+	// Interns paths into an append-only arena and hands out small integer ids for them.
+	// A path is copied exactly once, the first time it is seen, afterwards interning it is a hash lookup.
+	// Views returned by path() stay valid (and NUL terminated) until clear(), which makes them safe to hand to C APIs.
+	// The table only grows: every distinct path ever seen stays until clear(), including ones long gone from disk, so a
+	// tree that keeps making uniquely named files (logs, temporaries) keeps growing it. size() and bytes() tell by how much.
+	// Id 0 is always the empty path, so a default constructed PathId means "no path".
+	class PathTable
+	{
+	public:
+		PathTable()
+		{
+			clear();
+		}
+
+		PathTable(const PathTable&) = delete;
+		PathTable& operator=(const PathTable&) = delete;
+
+		PathId intern(const std::string_view path)
+		{
+			{
+				std::shared_lock<std::shared_mutex> lock(_mutex);
+				const auto found = _lookup.find(path);
+				if (found != _lookup.end()) return found->second;
+			}
+
+			std::unique_lock<std::shared_mutex> lock(_mutex);
+			const auto found = _lookup.find(path);
+			if (found != _lookup.end()) return found->second;
+
+			const std::string_view stored = store(path);
+			const PathId id = static_cast<PathId>(_paths.size());
+			_paths.push_back(stored);
+			_lookup.emplace(stored, id);
+			return id;
+		}
+
+		std::string_view path(const PathId id) const
+		{
+			std::shared_lock<std::shared_mutex> lock(_mutex);
+			return id < _paths.size() ? _paths[id] : std::string_view();
+		}
+
+		std::size_t size() const
+		{
+			std::shared_lock<std::shared_mutex> lock(_mutex);
+			return _paths.size();
+		}
+
+		// memory held by the arena, the ids and the lookup, roughly
+		std::size_t bytes() const
+		{
+			std::shared_lock<std::shared_mutex> lock(_mutex);
+			return _arena_bytes + _paths.capacity() * sizeof(std::string_view) + _lookup.size() * (sizeof(std::string_view) + sizeof(PathId) + 2 * sizeof(void*));
+		}
+
+		// Invalidates every id and view handed out so far, except for the empty path.
+		void clear()
+		{
+			std::unique_lock<std::shared_mutex> lock(_mutex);
+			_lookup.clear();
+			_paths.clear();
+			_blocks.clear();
+			_block_used = 0;
+			_block_size = 0;
+			_arena_bytes = 0;
+
+			const std::string_view empty = store(std::string_view());
+			_paths.push_back(empty);
+			_lookup.emplace(empty, 0);
+		}
+
+	private:
+		static constexpr std::size_t _default_block_size = 64 * 1024;
+
+		// _mutex must be held exclusively
+		std::string_view store(const std::string_view path)
+		{
+			const std::size_t needed = path.size() + 1;
+			if (_blocks.empty() || _block_size - _block_used < needed)
+			{
+				_block_size = std::max(_default_block_size, needed);
+				_blocks.emplace_back(new char[_block_size]);
+				_block_used = 0;
+				_arena_bytes += _block_size;
+			}
+
+			char* destination = _blocks.back().get() + _block_used;
+			if (!path.empty())
+				std::memcpy(destination, path.data(), path.size());
+			destination[path.size()] = '\0';
+			_block_used += needed;
+
+			return std::string_view(destination, path.size());
+		}
+
+		mutable std::shared_mutex _mutex;
+		std::unordered_map<std::string_view, PathId> _lookup;
+		std::vector<std::string_view> _paths;
+		std::vector<std::unique_ptr<char[]>> _blocks;
+		std::size_t _block_used = 0;
+		std::size_t _block_size = 0;
+		std::size_t _arena_bytes = 0;
+	};
+}
+#endif
@@ -0,0 +1,190 @@
+#ifndef PRIORITY_LANES_H
+#define PRIORITY_LANES_H
+
+#include <path_filter.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace filewatch {
+	// What a full lane does with one more change.
+	enum class LaneOverflow
+	{
+		DROP_OLDEST, // the oldest queued change makes room for it
+		AGGREGATE    // the change is only counted, the count is reported once the lane gets dispatched
+	};
+
+	struct LaneConfig
+	{
+		std::string name;
+		PathFilter match;          // paths this lane takes, an empty filter takes whatever no other lane matches
+		std::size_t capacity = 0;  // changes queued at most, 0 for no limit
+		LaneOverflow overflow = LaneOverflow::DROP_OLDEST;
+	};
+
+	// Backlog of changes split into priority classes, so a flood of data/ writes cannot hold back the lua/ changes
+	// queued behind it. Every change goes to the first lane with patterns its path passes, or to the first lane without
+	// any when none does, wherever it is in the order. Changes are taken out of the highest priority lane that has any,
+	// order is only kept within a lane. When no lane is without patterns, an unbounded "default" lane is added last.
+	// Not thread safe, it lives on the thread that dispatches.
+	template <typename Change>
+	class PriorityLanes
+	{
+	public:
+		PriorityLanes()
+		{
+			configure({}, [](const Change&) { return std::string_view(); });
+		}
+
+		// Replaces the lanes, highest priority first. Queued changes are sorted into the new lanes by path_of(change).
+		template <typename PathOf>
+		void configure(std::vector<LaneConfig> configs, PathOf&& path_of)
+		{
+			bool catch_all = false;
+			for (const LaneConfig& config : configs)
+				catch_all = catch_all || config.match.empty();
+
+			if (!catch_all)
+				configs.push_back(LaneConfig{ "default", PathFilter(), 0, LaneOverflow::DROP_OLDEST });
+
+			std::vector<Lane> previous = std::move(_lanes);
+			_lanes.clear();
+			for (LaneConfig& config : configs)
+				_lanes.push_back(Lane{ std::move(config), {}, 0, 0 });
+
+			_size = 0;
+			for (Lane& lane : previous)
+			{
+				// classified before it moves, path_of may look into the change itself
+				for (Change& change : lane.queue)
+					enqueue(classify(path_of(change)), std::move(change));
+			}
+		}
+
+		void push(Change change, const std::string_view path)
+		{
+			enqueue(classify(path), std::move(change));
+		}
+
+		// queues change last in the highest priority lane, regardless of its path and of capacities: ahead of every lower
+		// lane, behind what that lane already holds, so changes pushed first one after another keep their order
+		void push_first(Change change)
+		{
+			_lanes.front().queue.push_back(std::move(change));
+			++_size;
+		}
+
+		// takes the oldest change of the highest priority lane that has one
+		bool pop(Change& change)
+		{
+			for (Lane& lane : _lanes)
+			{
+				if (lane.queue.empty()) continue;
+
+				change = std::move(lane.queue.front());
+				lane.queue.pop_front();
+				--_size;
+				return true;
+			}
+
+			return false;
+		}
+
+		// Hands report(lane name, count) the changes each AGGREGATE lane turned away since the last call.
+		template <typename Report>
+		void take_aggregated(Report&& report)
+		{
+			for (Lane& lane : _lanes)
+			{
+				if (lane.aggregated == 0) continue;
+
+				report(lane.config.name, lane.aggregated);
+				lane.aggregated = 0;
+			}
+		}
+
+		// Hands report(lane name, count) every change each lane lost to its capacity since it was configured.
+		template <typename Report>
+		void for_each_dropped(Report&& report) const
+		{
+			for (const Lane& lane : _lanes)
+				report(lane.config.name, lane.dropped);
+		}
+
+		bool empty() const
+		{
+			return _size == 0;
+		}
+
+		std::size_t size() const
+		{
+			return _size;
+		}
+
+		void clear()
+		{
+			for (Lane& lane : _lanes)
+			{
+				lane.queue.clear();
+				lane.dropped = 0;
+				lane.aggregated = 0;
+			}
+			_size = 0;
+		}
+
+	private:
+		struct Lane
+		{
+			LaneConfig config;
+			std::deque<Change> queue;
+			std::uint64_t dropped;    // every change this lane lost to its capacity
+			std::uint64_t aggregated; // the AGGREGATE ones among them that were not reported yet
+		};
+
+		void enqueue(Lane& lane, Change&& change)
+		{
+			if (lane.config.capacity > 0 && lane.queue.size() >= lane.config.capacity)
+			{
+				++lane.dropped;
+				if (lane.config.overflow == LaneOverflow::AGGREGATE)
+				{
+					++lane.aggregated;
+					return;
+				}
+
+				lane.queue.pop_front();
+				--_size;
+			}
+
+			lane.queue.push_back(std::move(change));
+			++_size;
+		}
+
+		Lane& classify(const std::string_view path)
+		{
+			Lane* rest = nullptr;
+			for (Lane& lane : _lanes)
+			{
+				if (lane.config.match.empty())
+				{
+					if (rest == nullptr) rest = &lane;
+				}
+				else if (lane.config.match.passes(path))
+				{
+					return lane;
+				}
+			}
+
+			return *rest;
+		}
+
+		std::vector<Lane> _lanes;
+		std::size_t _size = 0;
+	};
+}
+#endif
@@ -0,0 +1,193 @@
+#ifndef SUBSCRIPTION_ROUTER_H
+#define SUBSCRIPTION_ROUTER_H
+
+#include <path_filter.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace filewatch {
+	// Routes paths to the subscriptions whose pattern (PathFilter syntax) they match, without testing every one of them.
+	// Subscriptions sit in a trie of directories under the literal directories their pattern starts with, so a path
+	// only gets tested against the ones on its way down: "lua/autorun/*.lua" is never looked at for "data/x.txt".
+	// Patterns without a '/' match file names at any depth and are tested for every path.
+	// Not thread safe.
+	template <typename Target>
+	class SubscriptionRouter
+	{
+	public:
+		typedef std::uint32_t Id;
+
+		// ids go up, going through them in order is going through the subscriptions in the order they were made
+		Id subscribe(const std::string& pattern, Target target)
+		{
+			const Id id = ++_last_id;
+			const std::vector<std::string> directories = literal_directories(pattern);
+
+			Node* node = &_root;
+			for (const std::string& directory : directories)
+			{
+				std::unique_ptr<Node>& child = node->children[directory];
+				if (!child)
+					child = std::make_unique<Node>();
+				node = child.get();
+			}
+			node->entries.push_back(Entry{ id, PathFilter({ pattern }, {}) });
+
+			_subscriptions.emplace(id, Subscription{ directories, std::move(target) });
+			return id;
+		}
+
+		// hands back what id was subscribed with, so whatever it holds can be let go of
+		bool unsubscribe(const Id id, Target& target)
+		{
+			const auto found = _subscriptions.find(id);
+			if (found == _subscriptions.end()) return false;
+
+			erase(_root, found->second.directories, 0, id);
+			target = std::move(found->second.target);
+			_subscriptions.erase(found);
+			return true;
+		}
+
+		const Target* target(const Id id) const
+		{
+			const auto found = _subscriptions.find(id);
+			return found == _subscriptions.end() ? nullptr : &found->second.target;
+		}
+
+		// appends the id of every subscription path matches to ids, in no particular order
+		void match(const std::string_view path, std::vector<Id>& ids) const
+		{
+			const Node* node = &_root;
+			std::string directory;
+			std::size_t start = 0;
+			while (true)
+			{
+				for (const Entry& entry : node->entries)
+				{
+					if (entry.filter.passes(path))
+						ids.push_back(entry.id);
+				}
+
+				std::size_t end = start;
+				while (end < path.size() && !PathFilter::is_separator(path[end]))
+					++end;
+				if (end == path.size()) return; // what is left is the file name
+
+				key(path.substr(start, end - start), directory);
+				const auto child = node->children.find(directory);
+				if (child == node->children.end()) return;
+
+				node = child->second.get();
+				start = end + 1;
+			}
+		}
+
+		template <typename Visit>
+		void for_each(Visit&& visit) const
+		{
+			for (const auto& subscription : _subscriptions)
+				visit(subscription.first, subscription.second.target);
+		}
+
+		bool empty() const
+		{
+			return _subscriptions.empty();
+		}
+
+		std::size_t size() const
+		{
+			return _subscriptions.size();
+		}
+
+		void clear()
+		{
+			_root.children.clear();
+			_root.entries.clear();
+			_subscriptions.clear();
+		}
+
+	private:
+		struct Entry
+		{
+			Id id;
+			PathFilter filter;
+		};
+
+		struct Node
+		{
+			std::unordered_map<std::string, std::unique_ptr<Node>> children;
+			std::vector<Entry> entries;
+		};
+
+		struct Subscription
+		{
+			std::vector<std::string> directories; // the trie keys of the node it is in
+			Target target;
+		};
+
+		// a component as the trie keys it, ignoring case where the file system does
+		static void key(const std::string_view component, std::string& output)
+		{
+			output.assign(component.data(), component.size());
+#ifdef _WIN32
+			for (char& character : output)
+				if (character >= 'A' && character <= 'Z') character = static_cast<char>(character - 'A' + 'a');
+#endif // _WIN32
+		}
+
+		// the components every path matching pattern is known to start with, the file name never counts
+		static std::vector<std::string> literal_directories(std::string_view pattern)
+		{
+			while (!pattern.empty() && PathFilter::is_separator(pattern.front()))
+				pattern.remove_prefix(1);
+
+			std::vector<std::string> directories;
+			std::size_t start = 0;
+			while (true)
+			{
+				std::size_t end = start;
+				while (end < pattern.size() && !PathFilter::is_separator(pattern[end]))
+					++end;
+				if (end == pattern.size()) break;
+
+				const std::string_view component = pattern.substr(start, end - start);
+				if (component.find_first_of("*?") != std::string_view::npos) break;
+
+				directories.emplace_back();
+				key(component, directories.back());
+				start = end + 1;
+			}
+			return directories;
+		}
+
+		// drops id from the node at directories, along with the nodes that are left with nothing in and below them
+		static void erase(Node& node, const std::vector<std::string>& directories, const std::size_t depth, const Id id)
+		{
+			if (depth == directories.size())
+			{
+				node.entries.erase(std::remove_if(node.entries.begin(), node.entries.end(), [id](const Entry& entry) { return entry.id == id; }), node.entries.end());
+				return;
+			}
+
+			const auto child = node.children.find(directories[depth]);
+			if (child == node.children.end()) return;
+
+			erase(*child->second, directories, depth + 1, id);
+			if (child->second->entries.empty() && child->second->children.empty())
+				node.children.erase(child);
+		}
+
+		Node _root;
+		std::unordered_map<Id, Subscription> _subscriptions;
+		Id _last_id = 0;
+	};
+}
+#endif
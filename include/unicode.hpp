@@ -0,0 +1,109 @@
+#ifndef UNICODE_H
+#define UNICODE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif // _WIN32
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FILEWATCH_SSE2 1
+#endif
+
+namespace filewatch {
+	// Appends length UTF-16 code units (WCHAR on Windows, char16_t anywhere) to output as UTF-8 in a single pass,
+	// turning '\' into '/' along the way when normalise_separators is set. Runs of ASCII, which nearly every path is
+	// made of, go 8 units at a time with SSE2. Unpaired surrogates, which Windows allows in file names, become U+FFFD.
+	template <typename Unit>
+	void append_utf8(const Unit* input, const std::size_t length, std::string& output, const bool normalise_separators = false)
+	{
+		static_assert(sizeof(Unit) == 2, "UTF-16 code units are 16 bits");
+
+		// 3 bytes per unit at most, a surrogate pair is 2 units for 4 bytes
+		const std::size_t start = output.size();
+		output.resize(start + length * 3);
+		char* out = &output[start];
+
+		std::size_t i = 0;
+		while (i < length)
+		{
+#ifdef FILEWATCH_SSE2
+			const __m128i non_ascii = _mm_set1_epi16(static_cast<short>(0xFF80));
+			const __m128i backslash = _mm_set1_epi16('\\');
+			const __m128i swap = _mm_set1_epi16('\\' ^ '/');
+			while (length - i >= 8)
+			{
+				__m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, non_ascii), _mm_setzero_si128())) != 0xFFFF) break;
+
+				if (normalise_separators)
+					units = _mm_xor_si128(units, _mm_and_si128(_mm_cmpeq_epi16(units, backslash), swap));
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(units, units));
+				out += 8;
+				i += 8;
+			}
+			if (i == length) break;
+#endif // FILEWATCH_SSE2
+
+			const std::uint32_t unit = static_cast<std::uint16_t>(input[i++]);
+			if (unit < 0x80)
+			{
+				*out++ = normalise_separators && unit == '\\' ? '/' : static_cast<char>(unit);
+				continue;
+			}
+
+			if (unit < 0x800)
+			{
+				*out++ = static_cast<char>(0xC0 | (unit >> 6));
+				*out++ = static_cast<char>(0x80 | (unit & 0x3F));
+				continue;
+			}
+
+			std::uint32_t code_point = unit;
+			if (unit >= 0xD800 && unit <= 0xDFFF)
+			{
+				const std::uint32_t low = i < length ? static_cast<std::uint16_t>(input[i]) : 0;
+				if (unit <= 0xDBFF && low >= 0xDC00 && low <= 0xDFFF)
+				{
+					++i;
+					code_point = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+					*out++ = static_cast<char>(0xF0 | (code_point >> 18));
+					*out++ = static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+					*out++ = static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+					*out++ = static_cast<char>(0x80 | (code_point & 0x3F));
+					continue;
+				}
+				code_point = 0xFFFD;
+			}
+
+			*out++ = static_cast<char>(0xE0 | (code_point >> 12));
+			*out++ = static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+			*out++ = static_cast<char>(0x80 | (code_point & 0x3F));
+		}
+
+		output.resize(static_cast<std::size_t>(out - output.data()));
+	}
+
+#ifdef _WIN32
+	// Paths are kept as UTF-8, the wide API takes them as UTF-16. Everything that opens or looks up a path on Windows
+	// goes through the W functions, the A ones would read it in the ANSI code page.
+	inline std::wstring widen(const std::string& path)
+	{
+		std::wstring wide;
+		const int length = MultiByteToWideChar(CP_UTF8, 0, path.data(), static_cast<int>(path.size()), nullptr, 0);
+		if (length <= 0) return wide;
+
+		wide.resize(static_cast<std::size_t>(length));
+		MultiByteToWideChar(CP_UTF8, 0, path.data(), static_cast<int>(path.size()), &wide[0], length);
+		return wide;
+	}
+#endif // _WIN32
+}
+#endif
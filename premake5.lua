@@ -21,4 +21,32 @@ CreateWorkspace({name = "io_events"})
 		IncludeLuaShared()
 		IncludeSDKCommon()
 		IncludeSDKTier0()
-		IncludeSDKTier1()
\ No newline at end of file
+		IncludeSDKTier1()
+
+	-- standalone, needs nothing from the engine: synthetic file storms through filewatch::FileWatch
+	project("filewatch_benchmark")
+		kind("ConsoleApp")
+		language("C++")
+		cppdialect("C++17")
+		files({"benchmark/*.cpp"})
+		vpaths({["Source files/*"] = "benchmark/*.cpp"})
+
+		filter("system:linux")
+			links({"pthread"})
+
+		filter({})
+
+	project("filewatch_stress")
+		kind("ConsoleApp")
+		language("C++")
+		cppdialect("C++17")
+		files({"tests/*.cpp"})
+		vpaths({["Source files/*"] = "tests/*.cpp"})
+
+		filter("system:linux")
+			links({"pthread"})
+
+		filter("system:windows")
+			links({"psapi"})
+
+		filter({})
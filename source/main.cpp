@@ -3,15 +3,129 @@
 #include <eiface.h>
 #include <dbg.h>
 #include <filewatch.hpp>
-#include <queue>
+#include <coalescer.hpp>
+#include <change_verifier.hpp>
+#include <content_prefetcher.hpp>
+#include <path_filter.hpp>
+#include <path_table.hpp>
+#include <priority_lanes.hpp>
+#include <change_queue.hpp>
+#include <latency_histogram.hpp>
+#include <subscription_router.hpp>
+#include <algorithm>
 #include <mutex>
 #include <cstring>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
 
-typedef std::pair<std::string, filewatch::Event> FileChange;
+// a path under one of the watched roots, the root's id in the upper half and the interned relative path in the lower
+typedef std::uint64_t ChangeKey;
 
-filewatch::FileWatch* watcher = nullptr;
-std::mutex changes_mtx;
-std::queue<FileChange> file_changes{};
+ChangeKey make_key(const filewatch::RootId root, const filewatch::PathId path)
+{
+	return (static_cast<ChangeKey>(root) << 32) | path;
+}
+
+filewatch::RootId key_root(const ChangeKey key)
+{
+	return static_cast<filewatch::RootId>(key >> 32);
+}
+
+filewatch::PathId key_path(const ChangeKey key)
+{
+	return static_cast<filewatch::PathId>(key);
+}
+
+struct FileChange
+{
+	ChangeKey path;
+	filewatch::Event type;
+	ChangeKey old_path; // the path a RENAMED entry had before, the empty path otherwise
+	filewatch::Clock::time_point queued; // when it was handed over to the game thread
+	std::shared_ptr<const std::string> contents; // the file's bytes when prefetching read them, nullptr otherwise
+};
+
+typedef filewatch::Coalescer<ChangeKey> ChangeCoalescer;
+typedef filewatch::ChangeVerifier<ChangeKey> ChangeVerifier;
+typedef filewatch::ContentPrefetcher<ChangeKey> ChangePrefetcher;
+typedef filewatch::PriorityLanes<FileChange> ChangeLanes;
+typedef filewatch::ChangeQueue<ChangeKey> ChangeQueue;
+
+// where the watcher hands every event, on the watch thread; a type of its own so the call inlines
+struct EventSink
+{
+	void operator()(const filewatch::FileEvent& event) const;
+};
+
+typedef filewatch::BasicFileWatch<EventSink> Watcher;
+
+Watcher* watcher = nullptr;
+filewatch::PathTable path_table{};
+std::string game_path{};
+ChangeCoalescer coalescer{};
+
+// between the threads producing changes and the game thread, collapsed changes are marked on the directory they are in
+ChangeQueue file_changes{ [](const ChangeKey path) {
+	const std::string_view relative = path_table.path(key_path(path));
+	return make_key(key_root(path), path_table.intern(filewatch::PathFilter::directory_name(relative)));
+} };
+
+// counters and latency histograms behind io_events.GetStats(), written from the watch thread as well as the game thread
+struct DispatchStats
+{
+	std::atomic<std::uint64_t> captured{0};   // events the watcher reported
+	std::atomic<std::uint64_t> queued{0};     // changes handed over to the game thread, after verification and coalescing
+	std::atomic<std::uint64_t> dispatched{0}; // changes handed to Lua
+	std::atomic<std::uint64_t> frames{0};     // frames that dispatched anything
+	filewatch::LatencyHistogram capture_to_queue;  // the OS read returning to the change being handed over
+	filewatch::LatencyHistogram queue_to_dispatch; // handed over to handed to Lua
+	filewatch::LatencyHistogram handler;           // a single hook.Run
+	filewatch::LatencyHistogram frame;             // a whole spew_file_events that dispatched anything
+};
+
+DispatchStats dispatch_stats{};
+filewatch::Clock::time_point last_stats_dump{};
+
+// what the watcher had to work around, reported from its threads and printed from the game thread
+std::mutex watch_errors_mutex;
+std::vector<std::string> watch_errors{};
+
+// set while content verification is on, swapped atomically since the watch thread reads it for every event
+std::shared_ptr<ChangeVerifier> verifier{};
+
+// a callback handed to io_events.Subscribe, the registry holds on to it
+struct Subscriber
+{
+	int callback;
+	bool every_watch;         // or only the changes under watch
+	filewatch::RootId watch;
+};
+
+typedef filewatch::SubscriptionRouter<Subscriber> SubscriberRouter;
+
+// only touched by the game thread
+SubscriberRouter subscribers{};
+std::vector<SubscriberRouter::Id> matched_subscribers{};
+
+// set while prefetching is on, with the paths it reads; only touched by the game thread, it prefetches after coalescing
+std::unique_ptr<ChangePrefetcher> prefetcher{};
+filewatch::PathFilter prefetch_filter{};
+
+// changes on their way to the backlog, in order, held back at the first one whose contents are still being read
+struct PrefetchingChange
+{
+	FileChange change;
+	std::shared_ptr<ChangePrefetcher::Request> request; // nullptr for changes that don't get their contents read
+};
+
+std::deque<PrefetchingChange> prefetching{};
+
+// changes taken off file_changes that did not fit into a frame's budget yet, sorted into priority lanes,
+// only touched by the game thread
+ChangeLanes dispatch_backlog{};
 
 std::string get_game_path(GarrysMod::Lua::ILuaBase* LUA) 
 {
@@ -28,92 +142,1294 @@ std::string get_game_path(GarrysMod::Lua::ILuaBase* LUA)
 	return game_dir;
 }
 
-void hook_run(lua_State* state, const char* path, const char* event_type)
+struct DispatchSettings
+{
+	bool batch = false;     // fire FileChangedBatch once per drain with every change in a table
+	bool per_event = true;  // keep firing FileChanged for every single change
+	double coalesce = 0;    // quiet window in seconds events on the same path are merged over, 0 disables merging
+	double coalesce_max_hold = 1; // seconds a path that never goes quiet is held at most before it is released anyway
+	double budget = 0.0005; // seconds of dispatch per frame before the rest is carried over, 0 for no limit
+	int max_events = 0;     // changes dispatched per frame at most, 0 for no limit
+	bool verify_content = false;                // drop CHANGED events whose file content is byte for byte the same
+	double verify_max_size = 16 * 1024 * 1024;  // files larger than this many bytes are never hashed
+	int queue_capacity = 0;                     // changes waiting for the game thread at most, 0 for no limit
+	filewatch::QueuePolicy queue_policy = filewatch::QueuePolicy::DROP_OLDEST;
+	double stats_interval = 0;                  // seconds between stats printed to the console, 0 to never print them
+	bool numeric_types = false;                 // hand event types to Lua as io_events.CREATED etc. instead of strings
+	bool cache_paths = false;                   // keep the Lua string of every path handed out, instead of pushing it anew
+	bool prefetch = false;                      // read changed files on worker threads and hand their contents out with the change
+	double prefetch_max_size = 1024 * 1024;     // files larger than this many bytes come without contents
+	double prefetch_cache = 2;                  // seconds a read is kept around to answer the next change of the same file
+	int prefetch_threads = 2;
+};
+
+DispatchSettings dispatch_settings{};
+
+// dispatch defaults tuned for the realm the module runs in, applied at require time before anything is configured
+enum class DispatchProfile
+{
+	CLIENT, // frames compete with rendering: a tight budget and few changes per frame
+	SERVER  // no rendering to keep out of the way of: no budget, many changes per tick
+};
+
+// "client" or "server", anything else is the realm the module was built for
+DispatchProfile parse_profile(const char* name)
 {
-	if (path == nullptr || event_type == nullptr) return;
+	if (std::strcmp(name, "client") == 0)
+		return DispatchProfile::CLIENT;
+	if (std::strcmp(name, "server") == 0)
+		return DispatchProfile::SERVER;
+	return IS_SERVERSIDE ? DispatchProfile::SERVER : DispatchProfile::CLIENT;
+}
+
+// every event type, exported as io_events.<name> = its number
+const filewatch::Event event_types[] = {
+	filewatch::Event::CREATED, filewatch::Event::DELETED, filewatch::Event::CHANGED, filewatch::Event::RENAMED_OLD,
+	filewatch::Event::RENAMED_NEW, filewatch::Event::RENAMED, filewatch::Event::QUEUE_OVERFLOW, filewatch::Event::DIRTY,
+	filewatch::Event::READY
+};
 
+// registry references to the Lua string of every path pushed while cache_paths is on, indexed by PathId, 0 for none yet
+// (references are never 0). path_table never forgets a path, so the cache starts over once it holds max_path_refs
+// strings rather than keep every path ever dispatched alive in Lua. Only touched by the game thread.
+std::vector<int> path_refs{};
+std::size_t path_ref_count = 0;
+constexpr std::size_t max_path_refs = 65536;
+
+void clear_path_refs(GarrysMod::Lua::ILuaBase* LUA)
+{
+	for (const int ref : path_refs)
+	{
+		if (ref != 0)
+			LUA->ReferenceFree(ref);
+	}
+	path_refs.clear();
+	path_ref_count = 0;
+}
+
+void push_path(GarrysMod::Lua::ILuaBase* LUA, const filewatch::PathId id)
+{
+	if (dispatch_settings.cache_paths && id < path_refs.size() && path_refs[id] != 0)
+	{
+		LUA->ReferencePush(path_refs[id]);
+		return;
+	}
+
+	const std::string_view path = path_table.path(id);
+	LUA->PushString(path.data(), static_cast<unsigned int>(path.size()));
+	if (!dispatch_settings.cache_paths) return;
+
+	if (path_ref_count >= max_path_refs)
+		clear_path_refs(LUA);
+	if (id >= path_refs.size())
+		path_refs.resize(static_cast<std::size_t>(id) + 1, 0);
+	LUA->Push(-1);
+	path_refs[id] = LUA->ReferenceCreate();
+	++path_ref_count;
+}
+
+void push_event_type(GarrysMod::Lua::ILuaBase* LUA, const filewatch::Event event_type)
+{
+	if (dispatch_settings.numeric_types)
+		LUA->PushNumber(static_cast<int>(event_type));
+	else
+		LUA->PushString(filewatch::event_name(event_type));
+}
+
+void push_contents(GarrysMod::Lua::ILuaBase* LUA, const FileChange& change)
+{
+	if (change.contents)
+		LUA->PushString(change.contents->data(), static_cast<unsigned int>(change.contents->size()));
+	else
+		LUA->PushNil();
+}
+
+// only touches how much is dispatched per frame; what is dispatched and whether it is held back first (batch,
+// coalesce) stays opt-in, the same in either realm, the rest of dispatch_settings is left alone
+void apply_profile(const DispatchProfile profile)
+{
+	if (profile == DispatchProfile::CLIENT)
+	{
+		dispatch_settings.budget = 0.0002;
+		dispatch_settings.max_events = 64;
+	}
+	else
+	{
+		// no time budget, max_events alone keeps a huge burst from stalling a tick
+		dispatch_settings.budget = 0;
+		dispatch_settings.max_events = 2048;
+	}
+}
+
+// IO_EVENTS_PROFILE = "client" | "server" set before require, the realm the module was built for if left out
+DispatchProfile get_profile(GarrysMod::Lua::ILuaBase* LUA)
+{
+	DispatchProfile profile = parse_profile("");
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+		LUA->GetField(-1, "IO_EVENTS_PROFILE");
+		if (LUA->IsType(-1, GarrysMod::Lua::Type::String))
+			profile = parse_profile(LUA->GetString(-1));
+	LUA->Pop(2);
+
+	return profile;
+}
+
+// IO_EVENTS_BACKEND = "fanotify" set before require picks the fanotify backend on Linux, anything else the native one
+filewatch::Backend get_backend(GarrysMod::Lua::ILuaBase* LUA)
+{
+	filewatch::Backend backend = filewatch::Backend::NATIVE;
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+		LUA->GetField(-1, "IO_EVENTS_BACKEND");
+		if (LUA->IsType(-1, GarrysMod::Lua::Type::String) && std::strcmp(LUA->GetString(-1), "fanotify") == 0)
+			backend = filewatch::Backend::FANOTIFY;
+	LUA->Pop(2);
+
+	return backend;
+}
+
+const char* get_backend_name(const filewatch::Backend backend)
+{
+	if (backend == filewatch::Backend::FANOTIFY)
+		return "fanotify";
+#ifdef _WIN32
+	return "ReadDirectoryChangesW";
+#else
+	return "inotify";
+#endif // _WIN32
+}
+
+void hook_run(lua_State* state, const FileChange& change)
+{
 	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
 	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
 		LUA->GetField(-1, "hook");
 			LUA->GetField(-1, "Run");
 				LUA->PushString("FileChanged");
-				LUA->PushString(path);
-				LUA->PushString(event_type);
-			LUA->PCall(3, 0, 0);
+				push_path(LUA, key_path(change.path));
+				push_event_type(LUA, change.type);
+				if (key_path(change.old_path) == 0)
+					LUA->PushNil();
+				else
+					push_path(LUA, key_path(change.old_path));
+				LUA->PushNumber(key_root(change.path));
+				push_contents(LUA, change);
+			if (LUA->PCall(6, 0, 0) != 0)
+				LUA->Pop(); // error message
 	LUA->Pop(2);
 }
 
-int spew_file_events(lua_State* state)
+// calls every subscriber the path (or for a rename, the path it had before) is of interest to, in the order they subscribed
+void run_subscribers(lua_State* state, const FileChange& change)
 {
-	changes_mtx.lock();
-	while (!file_changes.empty())
+	if (subscribers.empty()) return;
+
+	const filewatch::RootId root = key_root(change.path);
+	matched_subscribers.clear();
+	subscribers.match(path_table.path(key_path(change.path)), matched_subscribers);
+	if (key_path(change.old_path) != 0)
+		subscribers.match(path_table.path(key_path(change.old_path)), matched_subscribers);
+	if (matched_subscribers.empty()) return;
+
+	std::sort(matched_subscribers.begin(), matched_subscribers.end());
+	matched_subscribers.erase(std::unique(matched_subscribers.begin(), matched_subscribers.end()), matched_subscribers.end());
+
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	for (const SubscriberRouter::Id id : matched_subscribers)
 	{
-		FileChange change = file_changes.front();
-		file_changes.pop();
+		// looked up again every time, a callback may have unsubscribed the ones after it
+		const Subscriber* subscriber = subscribers.target(id);
+		if (subscriber == nullptr || (!subscriber->every_watch && subscriber->watch != root)) continue;
 
-		const char* event_type;
-		switch (change.second)
+		LUA->ReferencePush(subscriber->callback);
+			push_path(LUA, key_path(change.path));
+			push_event_type(LUA, change.type);
+			if (key_path(change.old_path) == 0)
+				LUA->PushNil();
+			else
+				push_path(LUA, key_path(change.old_path));
+			LUA->PushNumber(root);
+			push_contents(LUA, change);
+		if (LUA->PCall(5, 0, 0) != 0)
+		{
+			Warning("io_events: subscription %u failed: %s\n", static_cast<unsigned int>(id), LUA->GetString(-1));
+			LUA->Pop(); // error message
+		}
+	}
+}
+
+void clear_subscribers(GarrysMod::Lua::ILuaBase* LUA)
+{
+	subscribers.for_each([LUA](const SubscriberRouter::Id, const Subscriber& subscriber) {
+		LUA->ReferenceFree(subscriber.callback);
+	});
+	subscribers.clear();
+}
+
+// the OS lost events of root, what follows in the queue are the changes recovered by diffing against the last snapshot
+void hook_run_overflow(lua_State* state, const filewatch::RootId root)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+		LUA->GetField(-1, "hook");
+			LUA->GetField(-1, "Run");
+				LUA->PushString("FileWatchOverflow");
+				LUA->PushNumber(root);
+			if (LUA->PCall(2, 0, 0) != 0)
+				LUA->Pop(); // error message
+	LUA->Pop(2);
+}
+
+// every directory under root is covered by now, the initial walk is done
+void hook_run_ready(lua_State* state, const filewatch::RootId root)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+		LUA->GetField(-1, "hook");
+			LUA->GetField(-1, "Run");
+				LUA->PushString("FileWatchReady");
+				LUA->PushNumber(root);
+			if (LUA->PCall(2, 0, 0) != 0)
+				LUA->Pop(); // error message
+	LUA->Pop(2);
+}
+
+// a lane at capacity set to aggregate turned count changes away since the last frame
+void hook_run_dropped(lua_State* state, const std::string& lane, const std::uint64_t count)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+		LUA->GetField(-1, "hook");
+			LUA->GetField(-1, "Run");
+				LUA->PushString("FileChangesDropped");
+				LUA->PushString(lane.c_str());
+				LUA->PushNumber(static_cast<double>(count));
+			if (LUA->PCall(3, 0, 0) != 0)
+				LUA->Pop(); // error message
+	LUA->Pop(2);
+}
+
+// expects the batch table on top of the stack and leaves it there
+void hook_run_batch(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	const int batch = LUA->Top();
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+		LUA->GetField(-1, "hook");
+			LUA->GetField(-1, "Run");
+				LUA->PushString("FileChangedBatch");
+				LUA->Push(batch);
+			if (LUA->PCall(2, 0, 0) != 0)
+				LUA->Pop(); // error message
+	LUA->Pop(2);
+}
+
+// where every change ends up after interning (and verification), either merged by the coalescer or queued as is
+// the coalescer's quiet window starts at capture, so time spent in verification counts towards it
+void queue_change(const ChangeKey path, const filewatch::Event event_type, const ChangeKey old_path, const filewatch::Clock::time_point captured)
+{
+	if (coalescer.window() > ChangeCoalescer::Clock::duration::zero())
+	{
+		coalescer.push(path, event_type, old_path, captured);
+		return;
+	}
+
+	const filewatch::Clock::time_point now = filewatch::Clock::now();
+	dispatch_stats.capture_to_queue.record(now - captured);
+	++dispatch_stats.queued;
+	file_changes.push(path, event_type, old_path, now);
+}
+
+void set_verify_content(const bool enabled)
+{
+	std::shared_ptr<ChangeVerifier> next{};
+	if (enabled)
+	{
+		next = std::make_shared<ChangeVerifier>([](const ChangeKey path) {
+			return watcher->root_directory(key_root(path)) + "/" + std::string(path_table.path(key_path(path)));
+		}, queue_change, static_cast<std::uint64_t>(dispatch_settings.verify_max_size));
+		// queue_change can block, the verifier is bounded the same way so the watch thread is what waits then
+		next->set_limit(static_cast<std::size_t>(dispatch_settings.queue_capacity), dispatch_settings.queue_policy);
+	}
+
+	// the old verifier joins its worker once the watch thread lets go of its last reference to it
+	std::atomic_store(&verifier, std::move(next));
+}
+
+// a new prefetcher for the current settings, or none; what the old one had not read yet goes out without contents
+void set_prefetch(const bool enabled)
+{
+	prefetcher.reset();
+	if (!enabled) return;
+
+	prefetcher = std::make_unique<ChangePrefetcher>([](const ChangeKey path) {
+		return watcher->root_directory(key_root(path)) + "/" + std::string(path_table.path(key_path(path)));
+	}, static_cast<std::size_t>(dispatch_settings.prefetch_threads), static_cast<std::uint64_t>(dispatch_settings.prefetch_max_size),
+		std::chrono::duration_cast<filewatch::Clock::duration>(std::chrono::duration<double>(dispatch_settings.prefetch_cache)));
+}
+
+std::string_view get_change_path(const FileChange& change)
+{
+	return path_table.path(key_path(change.path));
+}
+
+// overflow markers go into the highest priority lane behind what it already holds, ahead of every other lane:
+// the recovered changes they announce may land in any lane, and they are queued after the marker anyway.
+// Ready markers, which are about no path in particular, go the same way and so stay behind the marker before them
+void backlog_change(FileChange change)
+{
+	if (change.type == filewatch::Event::QUEUE_OVERFLOW || change.type == filewatch::Event::READY)
+		dispatch_backlog.push_first(std::move(change));
+	else
+	{
+		const std::string_view path = get_change_path(change);
+		dispatch_backlog.push(std::move(change), path);
+	}
+}
+
+// asks the prefetcher for the contents of the files change leaves behind, and holds it until they are in
+void prefetch_change(FileChange change)
+{
+	std::shared_ptr<ChangePrefetcher::Request> request{};
+	if (prefetcher)
+	{
+		switch (change.type)
 		{
 			case filewatch::Event::CREATED:
-				event_type = "CREATED";
-				break;
-			case filewatch::Event::DELETED:
-				event_type = "DELETED";
-				break;
 			case filewatch::Event::CHANGED:
-				event_type = "CHANGED";
-				break;
+			case filewatch::Event::RENAMED:
 			case filewatch::Event::RENAMED_NEW:
-				event_type = "RENAMED_NEW";
+				if (key_path(change.path) != 0 && prefetch_filter.passes(get_change_path(change)))
+					request = prefetcher->request(change.path, change.queued);
+				if (change.type == filewatch::Event::RENAMED)
+					prefetcher->forget(change.old_path);
 				break;
+			case filewatch::Event::DELETED:
 			case filewatch::Event::RENAMED_OLD:
-				event_type = "RENAMED_OLD";
+				prefetcher->forget(change.path);
 				break;
 			default:
-				event_type = "UNKNOWN";
 				break;
 		}
+	}
+
+	// whatever comes after a change that is being read waits behind it, so no path's changes get out of order
+	if (request || !prefetching.empty())
+		prefetching.push_back(PrefetchingChange{ std::move(change), std::move(request) });
+	else
+		backlog_change(std::move(change));
+}
+
+// moves every change whose contents are in, up to the first one still being read, to the backlog
+void release_prefetched()
+{
+	while (!prefetching.empty())
+	{
+		PrefetchingChange& front = prefetching.front();
+		if (front.request)
+		{
+			if (!front.request->done.load(std::memory_order_acquire)) break;
+			front.change.contents = std::move(front.request->contents);
+		}
+
+		backlog_change(std::move(front.change));
+		prefetching.pop_front();
+	}
+}
+
+void print_watch_errors()
+{
+	std::vector<std::string> errors;
+	{
+		std::lock_guard<std::mutex> lock(watch_errors_mutex);
+		errors.swap(watch_errors);
+	}
+
+	for (const std::string& error : errors)
+		Warning("io_events: %s\n", error.c_str());
+}
+
+// sorts everything the watcher produced since the last frame into the backlog lanes
+void collect_file_events()
+{
+	print_watch_errors();
+
+	// takes everything queued so far in one go, the watcher must never wait on Lua
+	file_changes.drain([](const ChangeKey path, const filewatch::Event event_type, const ChangeKey old_path, const filewatch::Clock::time_point queued) {
+		prefetch_change(FileChange{ path, event_type, old_path, queued, nullptr });
+	});
+
+	// a merged change is as late as the first event it was merged from
+	const filewatch::Clock::time_point now = filewatch::Clock::now();
+	coalescer.drain([now](const ChangeKey path, const filewatch::Event event_type, const ChangeKey old_path, const filewatch::Clock::time_point first_seen) {
+		dispatch_stats.capture_to_queue.record(now - first_seen);
+		++dispatch_stats.queued;
+		prefetch_change(FileChange{ path, event_type, old_path, now, nullptr });
+	}, now);
+
+	release_prefetched();
+}
+
+void print_latency(const char* name, const filewatch::LatencyHistogram& histogram)
+{
+	const filewatch::LatencyHistogram::Summary summary = histogram.summary();
+	Msg("  %-18s %10llu  p50 %9.3fms  p90 %9.3fms  p99 %9.3fms  max %9.3fms\n", name, static_cast<unsigned long long>(summary.count),
+		summary.p50 * 1000, summary.p90 * 1000, summary.p99 * 1000, summary.max * 1000);
+}
+
+// what the queue to the game thread gave up so far, and the verifier in front of it
+filewatch::DropCounts get_queue_counts()
+{
+	filewatch::DropCounts counts = file_changes.counts();
+	const std::shared_ptr<ChangeVerifier> current = std::atomic_load(&verifier);
+	if (current)
+	{
+		const filewatch::DropCounts verifier_counts = current->counts();
+		counts.dropped += verifier_counts.dropped;
+		counts.blocked += verifier_counts.blocked;
+	}
+	return counts;
+}
+
+void print_stats()
+{
+	const filewatch::DropCounts drops = get_queue_counts();
+	Msg("io_events: %llu captured, %llu queued, %llu dispatched over %llu frames, %u waiting, %u in the backlog, %llu dropped, %llu collapsed\n",
+		static_cast<unsigned long long>(dispatch_stats.captured.load()), static_cast<unsigned long long>(dispatch_stats.queued.load()),
+		static_cast<unsigned long long>(dispatch_stats.dispatched.load()), static_cast<unsigned long long>(dispatch_stats.frames.load()),
+		static_cast<unsigned int>(file_changes.size()), static_cast<unsigned int>(dispatch_backlog.size()),
+		static_cast<unsigned long long>(drops.dropped), static_cast<unsigned long long>(drops.collapsed));
+	print_latency("capture -> queue", dispatch_stats.capture_to_queue);
+	print_latency("queue -> dispatch", dispatch_stats.queue_to_dispatch);
+	print_latency("handler", dispatch_stats.handler);
+	print_latency("frame", dispatch_stats.frame);
+}
+
+// runs every frame from the Think hook, dispatches as much of the backlog as the budget allows
+int spew_file_events(lua_State* state)
+{
+	if (dispatch_settings.stats_interval > 0)
+	{
+		const filewatch::Clock::time_point now = filewatch::Clock::now();
+		if (now - last_stats_dump >= std::chrono::duration<double>(dispatch_settings.stats_interval))
+		{
+			last_stats_dump = now;
+			print_stats();
+		}
+	}
+
+	collect_file_events();
+	if (dispatch_backlog.empty()) return 0;
+
+	using Clock = std::chrono::steady_clock;
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	const DispatchSettings settings = dispatch_settings;
+	const Clock::time_point started = Clock::now();
+	const Clock::duration budget = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(settings.budget));
 
-		hook_run(state, change.first.c_str(), event_type);
+	if (settings.batch)
+		LUA->CreateTable();
+
+	// at least one change goes out every frame, however slow its handlers are
+	int dispatched = 0;
+	int batch_size = 0;
+	FileChange change{};
+	while (!dispatch_backlog.empty())
+	{
+		const Clock::time_point now = Clock::now();
+		if (dispatched > 0)
+		{
+			if (settings.max_events > 0 && dispatched >= settings.max_events) break;
+			if (settings.budget > 0 && now - started >= budget) break;
+		}
+
+		dispatch_backlog.pop(change);
+		++dispatched;
+		dispatch_stats.queue_to_dispatch.record(now - change.queued);
+
+		if (change.type == filewatch::Event::QUEUE_OVERFLOW)
+		{
+			hook_run_overflow(state, key_root(change.path));
+			dispatch_stats.handler.record(Clock::now() - now);
+			continue;
+		}
+
+		if (change.type == filewatch::Event::READY)
+		{
+			hook_run_ready(state, key_root(change.path));
+			dispatch_stats.handler.record(Clock::now() - now);
+			continue;
+		}
+
+		if (settings.batch)
+		{
+			LUA->PushNumber(++batch_size);
+			LUA->CreateTable();
+				push_path(LUA, key_path(change.path));
+				LUA->SetField(-2, "path");
+				push_event_type(LUA, change.type);
+				LUA->SetField(-2, "type");
+				if (key_path(change.old_path) != 0)
+				{
+					push_path(LUA, key_path(change.old_path));
+					LUA->SetField(-2, "old_path");
+				}
+				LUA->PushNumber(key_root(change.path));
+				LUA->SetField(-2, "watch");
+				if (change.contents)
+				{
+					push_contents(LUA, change);
+					LUA->SetField(-2, "contents");
+				}
+			LUA->SetTable(-3);
+		}
+
+		if (settings.per_event)
+			hook_run(state, change);
+		run_subscribers(state, change);
+		if (settings.per_event || !subscribers.empty())
+			dispatch_stats.handler.record(Clock::now() - now);
 	}
-	changes_mtx.unlock();
 
+	if (settings.batch)
+	{
+		const Clock::time_point now = Clock::now();
+		hook_run_batch(state);
+		dispatch_stats.handler.record(Clock::now() - now);
+		LUA->Pop();
+	}
+
+	dispatch_backlog.take_aggregated([state](const std::string& lane, const std::uint64_t count) {
+		hook_run_dropped(state, lane, count);
+	});
+
+	dispatch_stats.dispatched += static_cast<std::uint64_t>(dispatched);
+	++dispatch_stats.frames;
+	dispatch_stats.frame.record(Clock::now() - started);
+
+	return 0;
+}
+
+void reset_stats()
+{
+	dispatch_stats.captured = 0;
+	dispatch_stats.queued = 0;
+	dispatch_stats.dispatched = 0;
+	dispatch_stats.frames = 0;
+	dispatch_stats.capture_to_queue.reset();
+	dispatch_stats.queue_to_dispatch.reset();
+	dispatch_stats.handler.reset();
+	dispatch_stats.frame.reset();
+}
+
+void push_latency(GarrysMod::Lua::ILuaBase* LUA, const filewatch::LatencyHistogram& histogram)
+{
+	const filewatch::LatencyHistogram::Summary summary = histogram.summary();
+	LUA->CreateTable();
+		LUA->PushNumber(static_cast<double>(summary.count));
+		LUA->SetField(-2, "count");
+		LUA->PushNumber(summary.mean);
+		LUA->SetField(-2, "mean");
+		LUA->PushNumber(summary.p50);
+		LUA->SetField(-2, "p50");
+		LUA->PushNumber(summary.p90);
+		LUA->SetField(-2, "p90");
+		LUA->PushNumber(summary.p99);
+		LUA->SetField(-2, "p99");
+		LUA->PushNumber(summary.max);
+		LUA->SetField(-2, "max");
+}
+
+// io_events.GetStats(reset) -> { captured, queued, dispatched, frames, waiting, backlog, dropped, collapsed, suppressed,
+//                                unverified, prefetched, prefetch_hits, ignored, paths, path_bytes, cached_paths,
+//                                capture_to_queue, queue_to_dispatch, handler, frame = { count, mean, p50, p90, p99, max } }
+// latencies are in seconds, reset clears the counters and histograms once they are read
+int get_stats(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	const filewatch::DropCounts drops = get_queue_counts();
+	const std::shared_ptr<ChangeVerifier> current = std::atomic_load(&verifier);
+
+	LUA->CreateTable();
+		LUA->PushNumber(static_cast<double>(dispatch_stats.captured.load()));
+		LUA->SetField(-2, "captured");
+		LUA->PushNumber(static_cast<double>(dispatch_stats.queued.load()));
+		LUA->SetField(-2, "queued");
+		LUA->PushNumber(static_cast<double>(dispatch_stats.dispatched.load()));
+		LUA->SetField(-2, "dispatched");
+		LUA->PushNumber(static_cast<double>(dispatch_stats.frames.load()));
+		LUA->SetField(-2, "frames");
+		LUA->PushNumber(static_cast<double>(file_changes.size()));
+		LUA->SetField(-2, "waiting");
+		LUA->PushNumber(static_cast<double>(dispatch_backlog.size()));
+		LUA->SetField(-2, "backlog");
+		LUA->PushNumber(static_cast<double>(drops.dropped));
+		LUA->SetField(-2, "dropped");
+		LUA->PushNumber(static_cast<double>(drops.collapsed));
+		LUA->SetField(-2, "collapsed");
+		LUA->PushNumber(current ? static_cast<double>(current->suppressed()) : 0);
+		LUA->SetField(-2, "suppressed");
+		LUA->PushNumber(current ? static_cast<double>(current->unverified()) : 0);
+		LUA->SetField(-2, "unverified");
+		LUA->PushNumber(prefetcher ? static_cast<double>(prefetcher->reads()) : 0);
+		LUA->SetField(-2, "prefetched");
+		LUA->PushNumber(prefetcher ? static_cast<double>(prefetcher->hits()) : 0);
+		LUA->SetField(-2, "prefetch_hits");
+		LUA->PushNumber(watcher ? static_cast<double>(watcher->ignored()) : 0);
+		LUA->SetField(-2, "ignored");
+		LUA->PushNumber(static_cast<double>(path_table.size()));
+		LUA->SetField(-2, "paths");
+		LUA->PushNumber(static_cast<double>(path_table.bytes()));
+		LUA->SetField(-2, "path_bytes");
+		LUA->PushNumber(static_cast<double>(path_ref_count));
+		LUA->SetField(-2, "cached_paths");
+		push_latency(LUA, dispatch_stats.capture_to_queue);
+		LUA->SetField(-2, "capture_to_queue");
+		push_latency(LUA, dispatch_stats.queue_to_dispatch);
+		LUA->SetField(-2, "queue_to_dispatch");
+		push_latency(LUA, dispatch_stats.handler);
+		LUA->SetField(-2, "handler");
+		push_latency(LUA, dispatch_stats.frame);
+		LUA->SetField(-2, "frame");
+
+	if (LUA->IsType(1, GarrysMod::Lua::Type::Bool) && LUA->GetBool(1))
+		reset_stats();
+
+	return 1;
+}
+
+// io_events.GetDropCounts() -> { dropped = count, collapsed = count, blocked = count, lanes = { [name] = count } }
+// what the queue between the watcher and the game thread, and each backlog lane, had to give up so far
+int get_drop_counts(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	const filewatch::DropCounts counts = get_queue_counts();
+
+	LUA->CreateTable();
+		LUA->PushNumber(static_cast<double>(counts.dropped));
+		LUA->SetField(-2, "dropped");
+		LUA->PushNumber(static_cast<double>(counts.collapsed));
+		LUA->SetField(-2, "collapsed");
+		LUA->PushNumber(static_cast<double>(counts.blocked));
+		LUA->SetField(-2, "blocked");
+		LUA->CreateTable();
+			dispatch_backlog.for_each_dropped([LUA](const std::string& lane, const std::uint64_t count) {
+				LUA->PushNumber(static_cast<double>(count));
+				LUA->SetField(-2, lane.c_str());
+			});
+		LUA->SetField(-2, "lanes");
+
+	return 1;
+}
+
+// reads the array of strings stored in field name of the table at index, missing fields give an empty list
+std::vector<std::string> get_string_list(GarrysMod::Lua::ILuaBase* LUA, int index, const char* name)
+{
+	std::vector<std::string> list;
+	LUA->GetField(index, name);
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::String))
+	{
+		list.emplace_back(LUA->GetString(-1));
+	}
+	else if (LUA->IsType(-1, GarrysMod::Lua::Type::Table))
+	{
+		for (int i = 1; ; ++i)
+		{
+			LUA->PushNumber(i);
+			LUA->GetTable(-2);
+			if (!LUA->IsType(-1, GarrysMod::Lua::Type::String))
+			{
+				LUA->Pop();
+				break;
+			}
+
+			list.emplace_back(LUA->GetString(-1));
+			LUA->Pop();
+		}
+	}
+	LUA->Pop();
+
+	return list;
+}
+
+// reads the lanes array stored in field lanes of the table at index, highest priority first
+std::vector<filewatch::LaneConfig> get_lanes(GarrysMod::Lua::ILuaBase* LUA, int index)
+{
+	std::vector<filewatch::LaneConfig> lanes;
+	LUA->GetField(index, "lanes");
+	for (int i = 1; ; ++i)
+	{
+		LUA->PushNumber(i);
+		LUA->GetTable(-2);
+		if (!LUA->IsType(-1, GarrysMod::Lua::Type::Table))
+		{
+			LUA->Pop();
+			break;
+		}
+
+		const int lane = LUA->Top();
+		filewatch::LaneConfig config{};
+		config.match = filewatch::PathFilter(get_string_list(LUA, lane, "include"), get_string_list(LUA, lane, "exclude"));
+
+		LUA->GetField(lane, "name");
+		config.name = LUA->IsType(-1, GarrysMod::Lua::Type::String) ? LUA->GetString(-1) : std::to_string(i);
+		LUA->Pop();
+
+		LUA->GetField(lane, "capacity");
+		if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+			config.capacity = static_cast<std::size_t>(std::max(0.0, LUA->GetNumber(-1)));
+		LUA->Pop();
+
+		LUA->GetField(lane, "overflow");
+		if (LUA->IsType(-1, GarrysMod::Lua::Type::String) && std::strcmp(LUA->GetString(-1), "aggregate") == 0)
+			config.overflow = filewatch::LaneOverflow::AGGREGATE;
+		LUA->Pop();
+
+		lanes.push_back(std::move(config));
+		LUA->Pop();
+	}
+	LUA->Pop();
+
+	return lanes;
+}
+
+// io_events.Configure({ profile = "client" | "server", batch = bool, per_event = bool, coalesce = seconds, coalesce_max_hold = seconds,
+//                       budget = seconds, max_events = count,
+//                       verify_content = bool, verify_max_size = bytes,
+//                       prefetch = bool | pattern | { patterns }, prefetch_max_size = bytes, prefetch_cache = seconds, prefetch_threads = count,
+//                       lanes = { { name = string, include = { patterns }, exclude = { patterns }, capacity = count,
+//                                   overflow = "drop_oldest" | "aggregate" }, ... },
+//                       queue_capacity = count, queue_policy = "block" | "drop_newest" | "drop_oldest" | "collapse",
+//                       stats_interval = seconds, numeric_types = bool, cache_paths = bool })
+// any field left out keeps its current value, a profile is applied before the fields next to it
+int configure(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	LUA->CheckType(1, GarrysMod::Lua::Type::Table);
+
+	LUA->GetField(1, "profile");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::String))
+		apply_profile(parse_profile(LUA->GetString(-1)));
+	LUA->Pop();
+
+	LUA->GetField(1, "batch");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Bool))
+		dispatch_settings.batch = LUA->GetBool(-1);
+	LUA->Pop();
+
+	LUA->GetField(1, "per_event");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Bool))
+		dispatch_settings.per_event = LUA->GetBool(-1);
+	LUA->Pop();
+
+	LUA->GetField(1, "coalesce");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+	{
+		dispatch_settings.coalesce = std::max(0.0, LUA->GetNumber(-1));
+		coalescer.set_window(std::chrono::duration_cast<ChangeCoalescer::Clock::duration>(std::chrono::duration<double>(dispatch_settings.coalesce)));
+	}
+	LUA->Pop();
+
+	LUA->GetField(1, "coalesce_max_hold");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+	{
+		dispatch_settings.coalesce_max_hold = std::max(0.0, LUA->GetNumber(-1));
+		coalescer.set_max_hold(std::chrono::duration_cast<ChangeCoalescer::Clock::duration>(std::chrono::duration<double>(dispatch_settings.coalesce_max_hold)));
+	}
+	LUA->Pop();
+
+	LUA->GetField(1, "budget");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+		dispatch_settings.budget = std::max(0.0, LUA->GetNumber(-1));
+	LUA->Pop();
+
+	LUA->GetField(1, "max_events");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+		dispatch_settings.max_events = std::max(0, static_cast<int>(LUA->GetNumber(-1)));
+	LUA->Pop();
+
+	LUA->GetField(1, "numeric_types");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Bool))
+		dispatch_settings.numeric_types = LUA->GetBool(-1);
+	LUA->Pop();
+
+	LUA->GetField(1, "cache_paths");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Bool))
+	{
+		dispatch_settings.cache_paths = LUA->GetBool(-1);
+		if (!dispatch_settings.cache_paths)
+			clear_path_refs(LUA);
+	}
+	LUA->Pop();
+
+	bool verify_changed = false;
+	LUA->GetField(1, "verify_max_size");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+	{
+		dispatch_settings.verify_max_size = std::max(0.0, LUA->GetNumber(-1));
+		verify_changed = true;
+	}
+	LUA->Pop();
+
+	LUA->GetField(1, "verify_content");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Bool))
+	{
+		verify_changed = verify_changed || dispatch_settings.verify_content != LUA->GetBool(-1);
+		dispatch_settings.verify_content = LUA->GetBool(-1);
+	}
+	LUA->Pop();
+
+	if (verify_changed)
+		set_verify_content(dispatch_settings.verify_content);
+
+	bool prefetch_changed = false;
+	LUA->GetField(1, "prefetch_max_size");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+	{
+		dispatch_settings.prefetch_max_size = std::max(0.0, LUA->GetNumber(-1));
+		prefetch_changed = true;
+	}
+	LUA->Pop();
+
+	LUA->GetField(1, "prefetch_cache");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+	{
+		dispatch_settings.prefetch_cache = std::max(0.0, LUA->GetNumber(-1));
+		prefetch_changed = true;
+	}
+	LUA->Pop();
+
+	LUA->GetField(1, "prefetch_threads");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+	{
+		dispatch_settings.prefetch_threads = std::max(1, static_cast<int>(LUA->GetNumber(-1)));
+		prefetch_changed = true;
+	}
+	LUA->Pop();
+
+	// patterns turn it on for the paths matching them only, true for every file
+	LUA->GetField(1, "prefetch");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Bool) || LUA->IsType(-1, GarrysMod::Lua::Type::Table) || LUA->IsType(-1, GarrysMod::Lua::Type::String))
+	{
+		const bool patterns = !LUA->IsType(-1, GarrysMod::Lua::Type::Bool);
+		prefetch_filter = patterns ? filewatch::PathFilter(get_string_list(LUA, 1, "prefetch"), {}) : filewatch::PathFilter();
+		prefetch_changed = prefetch_changed || dispatch_settings.prefetch != (patterns || LUA->GetBool(-1));
+		dispatch_settings.prefetch = patterns || LUA->GetBool(-1);
+	}
+	LUA->Pop();
+
+	if (prefetch_changed)
+		set_prefetch(dispatch_settings.prefetch);
+
+	LUA->GetField(1, "stats_interval");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+		dispatch_settings.stats_interval = std::max(0.0, LUA->GetNumber(-1));
+	LUA->Pop();
+
+	bool limit_changed = false;
+	LUA->GetField(1, "queue_capacity");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+	{
+		dispatch_settings.queue_capacity = std::max(0, static_cast<int>(LUA->GetNumber(-1)));
+		limit_changed = true;
+	}
+	LUA->Pop();
+
+	LUA->GetField(1, "queue_policy");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::String))
+	{
+		const std::string policy = LUA->GetString(-1);
+		if (policy == "block")
+			dispatch_settings.queue_policy = filewatch::QueuePolicy::BLOCK;
+		else if (policy == "drop_newest")
+			dispatch_settings.queue_policy = filewatch::QueuePolicy::DROP_NEWEST;
+		else if (policy == "collapse")
+			dispatch_settings.queue_policy = filewatch::QueuePolicy::COLLAPSE;
+		else
+			dispatch_settings.queue_policy = filewatch::QueuePolicy::DROP_OLDEST;
+		limit_changed = true;
+	}
+	LUA->Pop();
+
+	if (limit_changed)
+	{
+		file_changes.set_limit(static_cast<std::size_t>(dispatch_settings.queue_capacity), dispatch_settings.queue_policy);
+		const std::shared_ptr<ChangeVerifier> current = std::atomic_load(&verifier);
+		if (current)
+			current->set_limit(static_cast<std::size_t>(dispatch_settings.queue_capacity), dispatch_settings.queue_policy);
+	}
+
+	LUA->GetField(1, "lanes");
+	const bool has_lanes = LUA->IsType(-1, GarrysMod::Lua::Type::Table);
+	LUA->Pop();
+	if (has_lanes)
+		dispatch_backlog.configure(get_lanes(LUA, 1), get_change_path);
+
+	return 0;
+}
+
+// io_events.SetFilter({ include = { patterns }, exclude = { patterns } }), or io_events.SetFilter(nil) to drop the filter
+int set_filter(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	if (watcher == nullptr)
+		LUA->ThrowError("io_events is not watching anything");
+
+	if (LUA->IsType(1, GarrysMod::Lua::Type::Nil))
+	{
+		watcher->set_filter(nullptr);
+		return 0;
+	}
+
+	LUA->CheckType(1, GarrysMod::Lua::Type::Table);
+	auto filter = std::make_shared<const filewatch::PathFilter>(get_string_list(LUA, 1, "include"), get_string_list(LUA, 1, "exclude"));
+	watcher->set_filter(filter->empty() ? nullptr : filter);
+
+	return 0;
+}
+
+bool is_absolute_path(const std::string& path)
+{
+#ifdef _WIN32
+	return (path.size() > 1 && path[1] == ':') || (!path.empty() && (path[0] == '/' || path[0] == '\\'));
+#else
+	return !path.empty() && path[0] == '/';
+#endif // _WIN32
+}
+
+// IO_EVENTS_JOURNAL = "path" set before require keeps a journal there, relative to the garrysmod directory unless absolute
+std::string get_journal(GarrysMod::Lua::ILuaBase* LUA)
+{
+	std::string journal;
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+		LUA->GetField(-1, "IO_EVENTS_JOURNAL");
+		if (LUA->IsType(-1, GarrysMod::Lua::Type::String))
+			journal = LUA->GetString(-1);
+	LUA->Pop(2);
+
+	if (!journal.empty() && !is_absolute_path(journal))
+		journal = game_path + "/" + journal;
+	return journal;
+}
+
+// io_events.GetChangesSinceLastRun() -> { { path = string, type = type }, ... }, fresh; nil until FileWatchReady ran for
+// watch 0 or without IO_EVENTS_JOURNAL. fresh is true when there was no journal yet, everything is CREATED then.
+int get_changes_since_last_run(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	if (watcher == nullptr)
+		LUA->ThrowError("io_events is not watching anything");
+
+	filewatch::ChangesSinceLastRun changes;
+	if (!watcher->changes_since_last_run(changes))
+	{
+		LUA->PushNil();
+		return 1;
+	}
+
+	LUA->CreateTable();
+	int index = 0;
+	for (const auto& change : changes.changes)
+	{
+		LUA->PushNumber(++index);
+		LUA->CreateTable();
+			LUA->PushString(change.first.c_str(), static_cast<unsigned int>(change.first.size()));
+			LUA->SetField(-2, "path");
+			push_event_type(LUA, change.second);
+			LUA->SetField(-2, "type");
+		LUA->SetTable(-3);
+	}
+	LUA->PushBool(changes.fresh);
+	return 2;
+}
+
+// io_events.Watch(path, { include = { patterns }, exclude = { patterns } }) -> id, or nil and the reason it failed
+// relative paths are taken relative to the garrysmod directory, which is always watched as id 0
+int watch(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	if (watcher == nullptr)
+		LUA->ThrowError("io_events is not watching anything");
+
+	std::string path = LUA->CheckString(1);
+	if (!is_absolute_path(path))
+		path = game_path + "/" + path;
+
+	std::shared_ptr<const filewatch::PathFilter> filter{};
+	if (LUA->IsType(2, GarrysMod::Lua::Type::Table))
+	{
+		auto root_filter = std::make_shared<const filewatch::PathFilter>(get_string_list(LUA, 2, "include"), get_string_list(LUA, 2, "exclude"));
+		if (!root_filter->empty())
+			filter = std::move(root_filter);
+	}
+
+	// errors are handed back instead of raised, so nothing above is skipped over by a longjmp
+	std::string error;
+	try
+	{
+		LUA->PushNumber(watcher->add_root(path, std::move(filter)));
+		return 1;
+	}
+	catch (const std::exception& exception)
+	{
+		error = exception.what();
+	}
+
+	LUA->PushNil();
+	LUA->PushString(error.c_str());
+	return 2;
+}
+
+// io_events.Unwatch(id) -> whether there was something to stop watching
+int unwatch(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	if (watcher == nullptr)
+		LUA->ThrowError("io_events is not watching anything");
+
+	const double id = LUA->CheckNumber(1);
+	LUA->PushBool(id >= 0 && watcher->remove_root(static_cast<filewatch::RootId>(id)));
+	return 1;
+}
+
+// seconds since 1970 like file.Time, EntryState::modified is in nanoseconds since then on Linux and in 100ns ticks since 1601 on Windows
+double modified_seconds(const filewatch::EntryState& state)
+{
+#ifdef _WIN32
+	return static_cast<double>((state.modified - 116444736000000000LL) / 10000000);
+#else
+	return static_cast<double>(state.modified / 1000000000);
+#endif // _WIN32
+}
+
+filewatch::RootId get_watch_id(GarrysMod::Lua::ILuaBase* LUA, const int index)
+{
+	if (!LUA->IsType(index, GarrysMod::Lua::Type::Number)) return 0;
+
+	return static_cast<filewatch::RootId>(std::max(0.0, LUA->GetNumber(index)));
+}
+
+// io_events.Find(pattern, id) -> { files }, { directories }, paths relative to watch id (0 if left out), sorted within
+// each directory; nil until FileWatchReady ran for it. Answered from memory, see the README for the pattern syntax.
+int find(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	if (watcher == nullptr)
+		LUA->ThrowError("io_events is not watching anything");
+
+	const std::string pattern = LUA->CheckString(1);
+	const filewatch::RootId id = get_watch_id(LUA, 2);
+
+	LUA->CreateTable();
+	const int files = LUA->Top();
+	LUA->CreateTable();
+	const int directories = LUA->Top();
+	int file_count = 0;
+	int directory_count = 0;
+	const bool indexed = watcher->find(id, pattern, [&](const std::string_view path, const filewatch::EntryState& entry) {
+		LUA->PushNumber(entry.directory ? ++directory_count : ++file_count);
+		LUA->PushString(path.data(), static_cast<unsigned int>(path.size()));
+		LUA->SetTable(entry.directory ? directories : files);
+	});
+
+	if (!indexed)
+	{
+		LUA->Pop(2);
+		LUA->PushNil();
+		return 1;
+	}
+	return 2;
+}
+
+// io_events.Stat(path, id) -> { size = bytes, modified = seconds since 1970, directory = bool }, or nil when path is not
+// under watch id (0 if left out) or it is not ready yet
+int stat_path(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	if (watcher == nullptr)
+		LUA->ThrowError("io_events is not watching anything");
+
+	const std::string path = LUA->CheckString(1);
+	filewatch::EntryState entry{};
+	if (!watcher->lookup(get_watch_id(LUA, 2), path, entry))
+	{
+		LUA->PushNil();
+		return 1;
+	}
+
+	LUA->CreateTable();
+		LUA->PushNumber(static_cast<double>(entry.size));
+		LUA->SetField(-2, "size");
+		LUA->PushNumber(modified_seconds(entry));
+		LUA->SetField(-2, "modified");
+		LUA->PushBool(entry.directory);
+		LUA->SetField(-2, "directory");
+	return 1;
+}
+
+// io_events.Subscribe(pattern, callback, id) -> subscription id; callback(path, type, old_path, watch, contents) runs for
+// every change whose path matches pattern (see io_events.SetFilter), under watch id, or any watch if left out;
+// contents is what the file holds now when prefetch is on and it could be read, nil otherwise
+int subscribe(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	const std::string pattern = LUA->CheckString(1);
+	LUA->CheckType(2, GarrysMod::Lua::Type::Function);
+
+	Subscriber subscriber{};
+	subscriber.every_watch = !LUA->IsType(3, GarrysMod::Lua::Type::Number);
+	subscriber.watch = get_watch_id(LUA, 3);
+	LUA->Push(2);
+	subscriber.callback = LUA->ReferenceCreate();
+
+	LUA->PushNumber(subscribers.subscribe(pattern, subscriber));
+	return 1;
+}
+
+// io_events.Unsubscribe(id) -> whether it was subscribed
+int unsubscribe(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	const double id = LUA->CheckNumber(1);
+
+	Subscriber subscriber{};
+	const bool found = id > 0 && subscribers.unsubscribe(static_cast<SubscriberRouter::Id>(id), subscriber);
+	if (found)
+		LUA->ReferenceFree(subscriber.callback);
+
+	LUA->PushBool(found);
+	return 1;
+}
+
+// io_events.IgnoreNext(path, id, seconds): changes to path under watch id (0 if left out) are dropped for the next
+// seconds (1 if left out), for files about to be written by the game itself
+int ignore_next(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	if (watcher == nullptr)
+		LUA->ThrowError("io_events is not watching anything");
+
+	const std::string path = LUA->CheckString(1);
+	const double seconds = LUA->IsType(3, GarrysMod::Lua::Type::Number) ? std::max(0.0, LUA->GetNumber(3)) : 1.0;
+	watcher->ignore_next(get_watch_id(LUA, 2), path, std::chrono::duration_cast<filewatch::Clock::duration>(std::chrono::duration<double>(seconds)));
 	return 0;
 }
 
+// io_events.IsReady(id) -> whether every directory under the watch is covered, FileWatchReady(id) fires once it is
+int is_ready(lua_State* state)
+{
+	GarrysMod::Lua::ILuaBase* LUA = state->luabase;
+	if (watcher == nullptr)
+		LUA->ThrowError("io_events is not watching anything");
+
+	const double id = LUA->CheckNumber(1);
+	LUA->PushBool(id >= 0 && watcher->ready(static_cast<filewatch::RootId>(id)));
+	return 1;
+}
+
+void create_module_table(GarrysMod::Lua::ILuaBase* LUA)
+{
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+		LUA->CreateTable();
+			LUA->PushCFunction(configure);
+			LUA->SetField(-2, "Configure");
+			LUA->PushCFunction(get_drop_counts);
+			LUA->SetField(-2, "GetDropCounts");
+			LUA->PushCFunction(get_stats);
+			LUA->SetField(-2, "GetStats");
+			LUA->PushCFunction(set_filter);
+			LUA->SetField(-2, "SetFilter");
+			LUA->PushCFunction(watch);
+			LUA->SetField(-2, "Watch");
+			LUA->PushCFunction(unwatch);
+			LUA->SetField(-2, "Unwatch");
+			LUA->PushCFunction(is_ready);
+			LUA->SetField(-2, "IsReady");
+			LUA->PushCFunction(get_changes_since_last_run);
+			LUA->SetField(-2, "GetChangesSinceLastRun");
+			LUA->PushCFunction(find);
+			LUA->SetField(-2, "Find");
+			LUA->PushCFunction(stat_path);
+			LUA->SetField(-2, "Stat");
+			LUA->PushCFunction(subscribe);
+			LUA->SetField(-2, "Subscribe");
+			LUA->PushCFunction(ignore_next);
+			LUA->SetField(-2, "IgnoreNext");
+			LUA->PushCFunction(unsubscribe);
+			LUA->SetField(-2, "Unsubscribe");
+			LUA->PushString(get_backend_name(watcher->backend()));
+			LUA->SetField(-2, "BACKEND");
+			for (const filewatch::Event event_type : event_types)
+			{
+				LUA->PushNumber(static_cast<int>(event_type));
+				LUA->SetField(-2, filewatch::event_name(event_type));
+			}
+		LUA->SetField(-2, "io_events");
+	LUA->Pop();
+}
+
+void destroy_module_table(GarrysMod::Lua::ILuaBase* LUA)
+{
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+		LUA->PushNil();
+		LUA->SetField(-2, "io_events");
+	LUA->Pop();
+}
+
 void create_dispatcher(GarrysMod::Lua::ILuaBase* LUA)
 {
 	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
-		LUA->GetField(-1, "timer");
-			LUA->GetField(-1, "Create");
+		LUA->GetField(-1, "hook");
+			LUA->GetField(-1, "Add");
+				LUA->PushString("Think");
 				LUA->PushString("IOSpewFileEvents");
-				LUA->PushNumber(0.250);
-				LUA->PushNumber(0);
 				LUA->PushCFunction(spew_file_events);
-				LUA->PCall(4, 0, 0);
+				LUA->PCall(3, 0, 0);
 	LUA->Pop(2);
 }
 
 void destroy_dispatcher(GarrysMod::Lua::ILuaBase* LUA)
 {
 	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
-		LUA->GetField(-1, "timer");
-			LUA->GetField(-1, "Destroy");
+		LUA->GetField(-1, "hook");
+			LUA->GetField(-1, "Remove");
+				LUA->PushString("Think");
 				LUA->PushString("IOSpewFileEvents");
-			LUA->PCall(1, 0, 0);
+			LUA->PCall(2, 0, 0);
 	LUA->Pop(2);
 }
 
+// the only copy of a path is made here, the first time it is seen
+void EventSink::operator()(const filewatch::FileEvent& event) const
+{
+	const ChangeKey path = make_key(event.root, path_table.intern(event.path));
+	const ChangeKey old_path = make_key(event.root, event.old_path.empty() ? 0 : path_table.intern(event.old_path));
+
+	++dispatch_stats.captured;
+	const std::shared_ptr<ChangeVerifier> current = std::atomic_load(&verifier);
+	if (current)
+		current->push(path, event.type, old_path, event.captured);
+	else
+		queue_change(path, event.type, old_path, event.captured);
+}
+
 GMOD_MODULE_OPEN()
 {
-	watcher = new filewatch::FileWatch(get_game_path(LUA), [](std::string path, const filewatch::Event event_type) {
-		std::replace(path.begin(), path.end(), '\\', '/');
+	filewatch::Options options{};
+	options.delivery = filewatch::Delivery::DIRECT; // the callback only queues, so it can run on the watch thread itself
+	options.backend = get_backend(LUA);
 
-		changes_mtx.lock();
-		file_changes.push(FileChange(path, event_type));
-		changes_mtx.unlock();
-	});
+	game_path = get_game_path(LUA);
+	options.journal = get_journal(LUA);
+	options.index = true; // io_events.Find and io_events.Stat
+	options.on_error = [](const std::string& message) {
+		std::lock_guard<std::mutex> lock(watch_errors_mutex);
+		watch_errors.push_back(message);
+	};
+	watcher = new Watcher(game_path, EventSink{}, options);
+	print_watch_errors();
 
+	apply_profile(get_profile(LUA));
+	create_module_table(LUA);
 	create_dispatcher(LUA);
 
 	return 0;
@@ -122,12 +1438,37 @@ GMOD_MODULE_OPEN()
 GMOD_MODULE_CLOSE()
 {
 	destroy_dispatcher(LUA);
+	destroy_module_table(LUA);
+	dispatch_settings = DispatchSettings{};
+
+	// nobody drains file_changes anymore, producers blocked on it must not keep the threads below from being joined
+	file_changes.close();
+
+	// the verifier still asks the watcher where its roots are, so it goes first; once the watch thread
+	// lets go of it, its worker hands what is left to queue_change and is joined
+	std::atomic_store(&verifier, std::shared_ptr<ChangeVerifier>{});
+
+	// its workers ask the watcher where the roots are too
+	prefetcher.reset();
+	prefetching.clear();
+	prefetch_filter = filewatch::PathFilter();
+
+	// joins the watch thread, nothing produces events past this point
+	delete watcher;
+	watcher = nullptr;
+	print_watch_errors();
 
-	if (watcher != nullptr) 
-		watcher->~FileWatch();
+	// leave everything the way a fresh require expects it
+	file_changes.reset();
 
-	file_changes.~queue();
-	changes_mtx.~mutex();
+	coalescer.set_window(ChangeCoalescer::Clock::duration::zero());
+	coalescer.flush([](const ChangeKey, const filewatch::Event, const ChangeKey, const filewatch::Clock::time_point) {});
+	dispatch_backlog.configure({}, get_change_path);
+	dispatch_backlog.clear();
+	reset_stats();
+	clear_subscribers(LUA);
+	clear_path_refs(LUA);
+	path_table.clear();
 
 	return 0;
 }
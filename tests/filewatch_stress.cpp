@@ -0,0 +1,837 @@
+// Puts filewatch::FileWatch under concurrent load and checks what comes out, no game needed. Exits non-zero on failure.
+//
+//   lifecycle  every writer thread takes its own nested tree of files through create, write, rename, write, delete;
+//              every file has to go through all of it in order, nothing lost, nothing out of place
+//   tree       writers build nested trees while they are being watched and delete part of them again; replaying the
+//              events has to end up with exactly what is on disk
+//   renames    files are renamed between two directories both ways at once, moved out of the root and moved into it
+//              from outside at the same time; no rename may be paired up with the wrong half of another one
+//   saves      files are deleted and written anew right away, the way editors save atomically; whatever the kernel
+//              merged, every file has to end up existing, both in the events and in the index
+//   coalesce   a file is written to far more often than the coalescing window, it has to come out of the coalescer
+//              anyway, at least once every max hold
+//   cycles     watches are opened and closed over and over while files keep changing, the way the module is required
+//              and unloaded; every one has to get ready and none may leave file descriptors or threads behind
+//
+// Each scenario runs for every backend and both deliveries. lifecycle runs several rounds on one watch, the memory
+// the process holds may not keep growing from one round to the next.
+//
+//   filewatch_stress [--threads N] [--files N] [--rounds N] [--cycles N] [--backend all|native|fanotify]
+//                    [--scenario all|lifecycle|tree|renames|saves|coalesce|cycles] [--dir path]
+
+#include <filewatch.hpp>
+#include <coalescer.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <unistd.h>
+#endif // _WIN32
+
+namespace {
+	namespace fs = std::filesystem;
+	using filewatch::Clock;
+	using filewatch::Event;
+
+	struct Settings
+	{
+		std::size_t threads = 8;
+		std::size_t files = 500;   // per thread
+		std::size_t rounds = 3;
+		std::size_t cycles = 20;
+		std::string backend = "all";
+		std::string scenario = "all";
+		fs::path directory = fs::temp_directory_path() / "filewatch_stress";
+	};
+
+	struct Recorded
+	{
+		std::string path;
+		Event type;
+		std::string old_path;
+	};
+
+	// the callback, keeps every event in the order it was delivered
+	class Recorder
+	{
+	public:
+		void operator()(const filewatch::FileEvent& event)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_events.push_back(Recorded{ std::string(event.path), event.type, std::string(event.old_path) });
+			_last = Clock::now();
+		}
+
+		// waits until done(events) or until nothing came for quiet, and takes everything recorded
+		template <typename Done>
+		std::vector<Recorded> take(Done&& done, const Clock::duration quiet = std::chrono::seconds(2))
+		{
+			const Clock::time_point started = Clock::now();
+			while (Clock::now() - started < std::chrono::seconds(60))
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (done(_events) || Clock::now() - std::max(_last, started) > quiet) break;
+			}
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			std::vector<Recorded> events;
+			events.swap(_events);
+			return events;
+		}
+
+	private:
+		std::mutex _mutex;
+		std::vector<Recorded> _events;
+		Clock::time_point _last{};
+	};
+
+	bool overflowed(const std::vector<Recorded>& events)
+	{
+		for (const Recorded& event : events)
+		{
+			if (event.type == Event::QUEUE_OVERFLOW) return true;
+		}
+		return false;
+	}
+
+	void write_file(const fs::path& path, const char* contents, const bool append)
+	{
+		std::ofstream file(path, append ? std::ios::binary | std::ios::app : std::ios::binary | std::ios::trunc);
+		file << contents;
+	}
+
+	// files are named a letter from these and a number (f<number> on the way in and r<number> once renamed, and so
+	// on), directories never are
+	bool is_file_name(const std::string_view path)
+	{
+		const std::string_view name = filewatch::PathFilter::file_name(path);
+		return name.size() > 1 && std::strchr("fruvxyios", name[0]) != nullptr && name[1] >= '0' && name[1] <= '9';
+	}
+
+	// what the events say is on disk, files only
+	std::set<std::string> replay(const std::vector<Recorded>& events)
+	{
+		std::set<std::string> files;
+		for (const Recorded& event : events)
+		{
+			switch (event.type)
+			{
+				case Event::CREATED:
+				case Event::CHANGED:
+				case Event::RENAMED_NEW:
+					if (is_file_name(event.path)) files.insert(event.path);
+					break;
+				case Event::DELETED:
+				case Event::RENAMED_OLD:
+					files.erase(event.path);
+					break;
+				case Event::RENAMED:
+					files.erase(event.old_path);
+					if (is_file_name(event.path)) files.insert(event.path);
+					break;
+				default:
+					break;
+			}
+		}
+		return files;
+	}
+
+	std::set<std::string> files_on_disk(const fs::path& root, const fs::path& under)
+	{
+		std::set<std::string> files;
+		std::error_code error;
+		for (fs::recursive_directory_iterator entry(root / under, error), end; !error && entry != end; entry.increment(error))
+		{
+			if (entry->is_regular_file() && is_file_name(entry->path().filename().string()))
+				files.insert(entry->path().lexically_relative(root).generic_string());
+		}
+		return files;
+	}
+
+	bool same_files(const std::set<std::string>& replayed, const std::set<std::string>& disk, const char* scenario)
+	{
+		if (replayed == disk) return true;
+
+		std::size_t shown = 0;
+		for (const std::string& path : disk)
+		{
+			if (replayed.count(path) == 0 && shown++ < 5)
+				std::printf("    %s: %s is on disk, events never told\n", scenario, path.c_str());
+		}
+		for (const std::string& path : replayed)
+		{
+			if (disk.count(path) == 0 && shown++ < 10)
+				std::printf("    %s: %s is gone, events never told\n", scenario, path.c_str());
+		}
+		std::printf("    %s: %zu files replayed, %zu on disk\n", scenario, replayed.size(), disk.size());
+		return false;
+	}
+
+	std::size_t resident_memory()
+	{
+#ifdef _WIN32
+		PROCESS_MEMORY_COUNTERS counters{};
+		return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.WorkingSetSize : 0;
+#else
+		std::ifstream statm("/proc/self/statm");
+		std::size_t pages = 0;
+		std::size_t resident = 0;
+		statm >> pages >> resident;
+		return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif // _WIN32
+	}
+
+	// descriptors (handles on Windows) and threads the process holds, what a closed watch must give back
+	std::pair<std::size_t, std::size_t> process_resources()
+	{
+#ifdef _WIN32
+		DWORD handles = 0;
+		GetProcessHandleCount(GetCurrentProcess(), &handles);
+		return { handles, 0 };
+#else
+		const auto count = [](const char* directory) {
+			std::size_t entries = 0;
+			std::error_code error;
+			for (fs::directory_iterator entry(directory, error), end; !error && entry != end; entry.increment(error))
+				++entries;
+			return entries;
+		};
+		return { count("/proc/self/fd"), count("/proc/self/task") };
+#endif // _WIN32
+	}
+
+	class Stress
+	{
+	public:
+		Stress(const Settings& settings, const filewatch::Options options) :
+			_settings(settings),
+			_options(options)
+		{
+		}
+
+		// false when the backend asked for isn't available here, nothing was run then
+		bool run(bool& passed)
+		{
+			std::error_code error;
+			fs::remove_all(_settings.directory, error);
+			fs::create_directories(_settings.directory);
+
+			const bool all = _settings.scenario == "all";
+			if (all || _settings.scenario == "cycles")
+			{
+				if (!cycles(passed)) return false;
+			}
+
+			if (all || _settings.scenario == "saves")
+			{
+				if (!saves(passed)) return false;
+			}
+
+			if (all || _settings.scenario == "coalesce")
+			{
+				if (!coalesce(passed)) return false;
+			}
+
+			if (all || _settings.scenario == "lifecycle" || _settings.scenario == "tree" || _settings.scenario == "renames")
+			{
+				Recorder recorder;
+				filewatch::FileWatch watch(_settings.directory.string(), [&recorder](const filewatch::FileEvent& event) { recorder(event); }, _options);
+				if (watch.backend() != _options.backend) return false;
+				wait_ready(watch, 0);
+
+				if (all || _settings.scenario == "lifecycle")
+					passed = lifecycle(recorder) && passed;
+				if (all || _settings.scenario == "tree")
+					passed = tree(recorder) && passed;
+				if (all || _settings.scenario == "renames")
+					passed = renames(recorder) && passed;
+			}
+
+			fs::remove_all(_settings.directory, error);
+			return true;
+		}
+
+	private:
+		// where file number of a thread starts out and where it is renamed to, three levels deep, every other one
+		// moving to the next level down
+		fs::path lifecycle_directory(const std::size_t thread, const std::size_t level) const
+		{
+			fs::path directory = fs::path("life") / ("t" + std::to_string(thread));
+			for (std::size_t depth = 0; depth <= level; ++depth)
+				directory /= "d" + std::to_string(depth);
+			return directory;
+		}
+
+		fs::path original_path(const std::size_t thread, const std::size_t number) const
+		{
+			return lifecycle_directory(thread, number % 3) / ("f" + std::to_string(number));
+		}
+
+		fs::path renamed_path(const std::size_t thread, const std::size_t number) const
+		{
+			return lifecycle_directory(thread, number % 2 == 0 ? number % 3 : (number + 1) % 3) / ("r" + std::to_string(number));
+		}
+
+		static bool wait_ready(const filewatch::FileWatch& watch, const filewatch::RootId root)
+		{
+			const Clock::time_point started = Clock::now();
+			while (!watch.ready(root))
+			{
+				if (Clock::now() - started > std::chrono::seconds(10)) return false;
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			return true;
+		}
+
+		template <typename Work>
+		void run_writers(Work&& work)
+		{
+			std::vector<std::thread> writers;
+			for (std::size_t thread = 0; thread < _settings.threads; ++thread)
+				writers.emplace_back([&work, thread]() { work(thread); });
+			for (std::thread& writer : writers)
+				writer.join();
+		}
+
+		bool lifecycle(Recorder& recorder)
+		{
+			// laid out before the storm, every file's whole life has to be seen from its very first event
+			for (std::size_t thread = 0; thread < _settings.threads; ++thread)
+				fs::create_directories(_settings.directory / lifecycle_directory(thread, 2));
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			recorder.take([](const std::vector<Recorded>&) { return false; }, std::chrono::milliseconds(200));
+
+			// where every file is in its life, as told by the events
+			enum Stage { NONE, CREATED, MOVING, MOVED, DONE };
+			struct File
+			{
+				Stage stage = NONE;
+			};
+
+			bool passed = true;
+			std::size_t baseline = 0;
+			for (std::size_t round = 0; round < _settings.rounds; ++round)
+			{
+				const std::size_t total = _settings.threads * _settings.files;
+				std::vector<File> files(total);
+				std::unordered_map<std::string, std::pair<std::size_t, bool>> paths; // path -> file, whether it is the renamed one
+				for (std::size_t thread = 0; thread < _settings.threads; ++thread)
+				{
+					for (std::size_t number = 0; number < _settings.files; ++number)
+					{
+						paths[original_path(thread, number).generic_string()] = { thread * _settings.files + number, false };
+						paths[renamed_path(thread, number).generic_string()] = { thread * _settings.files + number, true };
+					}
+				}
+
+				// in waves, so thousands of files are somewhere in their life at the same time
+				const Clock::time_point started = Clock::now();
+				run_writers([this](const std::size_t thread) {
+					for (std::size_t number = 0; number < _settings.files; ++number)
+					{
+						const fs::path path = _settings.directory / original_path(thread, number);
+						write_file(path, "created", false);
+						write_file(path, " and written to", true);
+					}
+					for (std::size_t number = 0; number < _settings.files; ++number)
+						fs::rename(_settings.directory / original_path(thread, number), _settings.directory / renamed_path(thread, number));
+					for (std::size_t number = 0; number < _settings.files; ++number)
+					{
+						const fs::path path = _settings.directory / renamed_path(thread, number);
+						write_file(path, " once more", true);
+						fs::remove(path);
+					}
+				});
+
+				std::size_t deleted = 0;
+				const std::vector<Recorded> events = recorder.take([&deleted, total](const std::vector<Recorded>& events) {
+					// every file ends with the DELETED of its renamed path, counted from where the last look stopped
+					deleted = 0;
+					for (const Recorded& event : events)
+					{
+						if (event.type == Event::DELETED && is_file_name(event.path) && filewatch::PathFilter::file_name(event.path)[0] == 'r')
+							++deleted;
+					}
+					return deleted >= total;
+				});
+				const double seconds = std::chrono::duration<double>(Clock::now() - started).count();
+
+				if (overflowed(events))
+				{
+					// events were lost to the kernel and recovered by the resync, only the outcome can be checked
+					std::printf("    lifecycle round %zu: the kernel queue overflowed, checking the outcome only\n", round);
+					passed = same_files(replay(events), files_on_disk(_settings.directory, "life"), "lifecycle") && passed;
+					continue;
+				}
+
+				std::size_t violations = 0;
+				std::size_t split = 0;
+				const auto violation = [&violations](const Recorded& event, const char* why) {
+					if (violations++ < 10)
+						std::printf("    lifecycle: %s %s%s%s: %s\n", filewatch::event_name(event.type), event.old_path.c_str(),
+							event.old_path.empty() ? "" : " -> ", event.path.c_str(), why);
+				};
+
+				for (const Recorded& event : events)
+				{
+					const auto found = paths.find(event.path);
+					if (found == paths.end()) continue; // directories
+
+					File& file = files[found->second.first];
+					const bool renamed = found->second.second;
+					switch (event.type)
+					{
+						case Event::CREATED:
+							// the new half of a rename told as moved in from outside, see DELETED
+							if (renamed && file.stage == MOVING) file.stage = MOVED;
+							else if (renamed || file.stage != NONE) violation(event, "created out of order");
+							else file.stage = CREATED;
+							break;
+						case Event::CHANGED:
+							if (file.stage != (renamed ? MOVED : CREATED)) violation(event, "changed out of order");
+							break;
+						case Event::RENAMED_OLD:
+							if (renamed || file.stage != CREATED) violation(event, "moved away out of order");
+							else file.stage = MOVING;
+							break;
+						case Event::RENAMED_NEW:
+							if (!renamed || file.stage != MOVING) violation(event, "moved in out of order");
+							else file.stage = MOVED;
+							break;
+						case Event::RENAMED:
+						{
+							const auto old_path = paths.find(event.old_path);
+							if (!renamed || old_path == paths.end() || old_path->second.first != found->second.first) violation(event, "paired with the wrong rename");
+							else if (file.stage != CREATED) violation(event, "renamed out of order");
+							else file.stage = MOVED;
+							break;
+						}
+						case Event::DELETED:
+							// a rename whose halves another writer got in between of is told as moved out of the tree
+							// and back in, still in order and with nothing lost
+							if (!renamed && file.stage == CREATED)
+							{
+								file.stage = MOVING;
+								++split;
+							}
+							else if (!renamed || file.stage != MOVED) violation(event, "deleted out of order");
+							else file.stage = DONE;
+							break;
+						default:
+							violation(event, "unexpected");
+							break;
+					}
+				}
+
+				std::size_t lost = 0;
+				for (const File& file : files)
+				{
+					if (file.stage != DONE) ++lost;
+				}
+
+				const std::size_t memory = resident_memory();
+				if (round == 0) baseline = memory;
+				std::printf("    lifecycle round %zu: %zu events for %zu files in %.2fs, %zu lost, %zu out of order, %zu renames split, %.1f MB resident\n",
+					round, events.size(), total, seconds, lost, violations, split, static_cast<double>(memory) / (1024 * 1024));
+				passed = passed && lost == 0 && violations == 0;
+			}
+
+			// the first round grows every buffer to what the load needs, from then on it has to stay flat
+			const std::size_t memory = resident_memory();
+			if (_settings.rounds > 1 && memory > baseline + 32 * 1024 * 1024)
+			{
+				std::printf("    lifecycle: resident memory grew from %.1f MB to %.1f MB\n",
+					static_cast<double>(baseline) / (1024 * 1024), static_cast<double>(memory) / (1024 * 1024));
+				passed = false;
+			}
+			return passed;
+		}
+
+		bool tree(Recorder& recorder)
+		{
+			// directories are created as fast as the files in them, many before the watcher got to arm them
+			const Clock::time_point started = Clock::now();
+			run_writers([this](const std::size_t thread) {
+				for (std::size_t branch = 0; branch < _settings.files / 25 + 1; ++branch)
+				{
+					fs::path directory = _settings.directory / "tree" / ("t" + std::to_string(thread)) / ("b" + std::to_string(branch));
+					for (std::size_t depth = 0; depth < 5; ++depth)
+					{
+						directory /= "d" + std::to_string(depth);
+						fs::create_directories(directory);
+						for (std::size_t number = 0; number < 5; ++number)
+						{
+							const fs::path path = directory / ("f" + std::to_string(number));
+							write_file(path, "tree", false);
+							if ((branch + depth + number) % 3 == 0)
+								fs::remove(path);
+						}
+					}
+				}
+			});
+
+			const std::set<std::string> disk = files_on_disk(_settings.directory, "tree");
+			const std::vector<Recorded> events = recorder.take([&disk](const std::vector<Recorded>& events) { return replay(events) == disk; });
+			const std::set<std::string> replayed = replay(events);
+			std::printf("    tree: %zu events, %zu files on disk in %.2fs%s\n", events.size(), disk.size(),
+				std::chrono::duration<double>(Clock::now() - started).count(), overflowed(events) ? ", the kernel queue overflowed" : "");
+			return same_files(replayed, disk, "tree");
+		}
+
+		bool renames(Recorder& recorder)
+		{
+			// x files go from a to b while u files go from b to a, o files leave the root while i files come in
+			// from outside, all at once: the halves of one rename are always mixed in with the halves of others
+			const fs::path a = _settings.directory / "ren" / "a";
+			const fs::path b = _settings.directory / "ren" / "b";
+			const fs::path outside = fs::path(_settings.directory.native() + fs::path("_outside").native());
+			fs::create_directories(a);
+			fs::create_directories(b);
+			fs::create_directories(outside);
+
+			const auto name = [](const char* prefix, const std::size_t number) { return prefix + std::to_string(number); };
+			const auto relative = [](const char* directory, const std::string& file) { return std::string("ren/") + directory + "/" + file; };
+			std::unordered_map<std::string, std::string> renamed; // old path -> new path, the only pairs a RENAMED may be
+			std::set<std::string> gone;   // moved out, has to be told as deleted
+			std::set<std::string> coming; // moved in, has to be told as created
+			for (std::size_t number = 0; number < _settings.files; ++number)
+			{
+				write_file(a / name("x", number), "renames", false);
+				write_file(b / name("u", number), "renames", false);
+				write_file(a / name("o", number), "renames", false);
+				write_file(outside / name("i", number), "renames", false);
+				renamed[relative("a", name("x", number))] = relative("b", name("y", number));
+				renamed[relative("b", name("u", number))] = relative("a", name("v", number));
+				gone.insert(relative("a", name("o", number)));
+				coming.insert(relative("b", name("i", number)));
+			}
+			recorder.take([](const std::vector<Recorded>&) { return false; }, std::chrono::milliseconds(500));
+
+			const Clock::time_point started = Clock::now();
+			std::vector<std::thread> writers;
+			writers.emplace_back([&]() { for (std::size_t number = 0; number < _settings.files; ++number) fs::rename(a / name("x", number), b / name("y", number)); });
+			writers.emplace_back([&]() { for (std::size_t number = 0; number < _settings.files; ++number) fs::rename(b / name("u", number), a / name("v", number)); });
+			writers.emplace_back([&]() { for (std::size_t number = 0; number < _settings.files; ++number) fs::rename(a / name("o", number), outside / name("o", number)); });
+			writers.emplace_back([&]() { for (std::size_t number = 0; number < _settings.files; ++number) fs::rename(outside / name("i", number), b / name("i", number)); });
+			for (std::thread& writer : writers)
+				writer.join();
+
+			// every rename is either told as one, or as its old name deleted and its new one created
+			std::size_t wrong = 0;
+			std::size_t split = 0;
+			std::set<std::string> created;
+			std::set<std::string> deleted;
+			const auto check = [&](const std::vector<Recorded>& events, const bool report) {
+				wrong = 0;
+				split = 0;
+				created.clear();
+				deleted.clear();
+				for (const Recorded& event : events)
+				{
+					if (event.type == Event::RENAMED)
+					{
+						const auto found = renamed.find(event.old_path);
+						if (found != renamed.end() && found->second == event.path)
+						{
+							deleted.insert(event.old_path);
+							created.insert(event.path);
+						}
+						else if (wrong++ < 10 && report)
+						{
+							std::printf("    renames: RENAMED %s -> %s: paired with the wrong rename\n", event.old_path.c_str(), event.path.c_str());
+						}
+					}
+					else if (event.type == Event::DELETED || event.type == Event::RENAMED_OLD)
+					{
+						deleted.insert(event.path);
+						split += renamed.count(event.path);
+					}
+					else if (event.type == Event::CREATED || event.type == Event::RENAMED_NEW)
+					{
+						created.insert(event.path);
+					}
+				}
+
+				std::size_t missing = 0;
+				for (const auto& pair : renamed)
+					missing += (deleted.count(pair.first) == 0) + (created.count(pair.second) == 0);
+				for (const std::string& path : gone)
+					missing += deleted.count(path) == 0;
+				for (const std::string& path : coming)
+					missing += created.count(path) == 0;
+				return missing;
+			};
+
+			const std::vector<Recorded> events = recorder.take([&check](const std::vector<Recorded>& events) { return check(events, false) == 0; });
+			fs::remove_all(outside);
+			if (overflowed(events))
+			{
+				std::printf("    renames: the kernel queue overflowed, checking the outcome only\n");
+				return same_files(replay(events), files_on_disk(_settings.directory, "ren"), "renames");
+			}
+
+			const std::size_t missing = check(events, true);
+			std::printf("    renames: %zu interleaved renames and moves in %.2fs, %zu missed, %zu paired wrong, %zu split\n", 4 * _settings.files,
+				std::chrono::duration<double>(Clock::now() - started).count(), missing, wrong, split);
+			return missing == 0 && wrong == 0;
+		}
+
+		bool saves(bool& passed)
+		{
+			const fs::path root = _settings.directory / "save";
+			fs::create_directories(root);
+			for (std::size_t number = 0; number < _settings.files; ++number)
+				write_file(root / ("s" + std::to_string(number)), "saves", false);
+
+			filewatch::Options options = _options;
+			options.index = true;
+			Recorder recorder;
+			filewatch::FileWatch watch(root.string(), [&recorder](const filewatch::FileEvent& event) { recorder(event); }, options);
+			if (watch.backend() != _options.backend) return false;
+			wait_ready(watch, 0);
+
+			const Clock::time_point started = Clock::now();
+			run_writers([this, &root](const std::size_t thread) {
+				for (std::size_t number = thread; number < _settings.files; number += _settings.threads)
+				{
+					const fs::path path = root / ("s" + std::to_string(number));
+					fs::remove(path);
+					write_file(path, "saved", false);
+				}
+			});
+
+			// the recreation of every file comes after its deletion, so each has to end on something else
+			std::unordered_map<std::string, Event> last;
+			const std::vector<Recorded> events = recorder.take([&last, this](const std::vector<Recorded>& events) {
+				last.clear();
+				for (const Recorded& event : events)
+					last[event.path] = event.type;
+				std::size_t saved = 0;
+				for (const auto& entry : last)
+					saved += entry.second != Event::DELETED;
+				return saved >= _settings.files;
+			});
+
+			std::size_t deleted = 0;
+			std::size_t unindexed = 0;
+			for (std::size_t number = 0; number < _settings.files; ++number)
+			{
+				const std::string path = "s" + std::to_string(number);
+				const auto found = last.find(path);
+				deleted += found == last.end() || found->second == Event::DELETED;
+
+				filewatch::EntryState state;
+				unindexed += !watch.lookup(0, path, state);
+			}
+
+			std::printf("    saves: %zu files deleted and written anew in %.2fs, %zu told as gone, %zu missing from the index%s\n", _settings.files,
+				std::chrono::duration<double>(Clock::now() - started).count(), deleted, unindexed, overflowed(events) ? ", the kernel queue overflowed" : "");
+			passed = passed && (deleted == 0 || overflowed(events)) && unindexed == 0;
+			return true;
+		}
+
+		bool coalesce(bool& passed)
+		{
+			// a window a client would configure, and the default max hold
+			const Clock::duration window = std::chrono::milliseconds(250);
+			const Clock::duration max_hold = std::chrono::seconds(1);
+			const Clock::duration writing = std::chrono::seconds(3);
+			const fs::path path = _settings.directory / "coalesce" / "f0";
+			fs::create_directories(path.parent_path());
+
+			filewatch::Coalescer<std::string> coalescer(window, max_hold);
+			filewatch::FileWatch watch((_settings.directory / "coalesce").string(), [&coalescer](const filewatch::FileEvent& event) {
+				coalescer.push(std::string(event.path), event.type, std::string(event.old_path), event.captured);
+			}, _options);
+			if (watch.backend() != _options.backend) return false;
+			wait_ready(watch, 0);
+
+			// written every 20 ms, the window is never quiet
+			std::atomic_bool stop{false};
+			std::thread writer([&path, &stop]() {
+				while (!stop)
+				{
+					write_file(path, "coalesce", true);
+					std::this_thread::sleep_for(std::chrono::milliseconds(20));
+				}
+			});
+
+			// drained every tick like the game does, the longest gap between releases is what a script would wait
+			const Clock::time_point started = Clock::now();
+			Clock::time_point last = started;
+			Clock::duration longest = Clock::duration::zero();
+			std::size_t released = 0;
+			while (Clock::now() - started < writing)
+			{
+				coalescer.drain([&](const std::string&, const Event, const std::string&, const Clock::time_point) {
+					const Clock::time_point now = Clock::now();
+					longest = std::max(longest, now - last);
+					last = now;
+					++released;
+				});
+				std::this_thread::sleep_for(std::chrono::milliseconds(15));
+			}
+			longest = std::max(longest, Clock::now() - last);
+			stop = true;
+			writer.join();
+
+			// a tick and a bit of slack on top of the max hold, the first event takes a moment to get there
+			const bool held_too_long = longest > max_hold + std::chrono::milliseconds(250);
+			std::printf("    coalesce: a file written every 20 ms released %zu times in %.1fs, %.0f ms apart at most\n", released,
+				std::chrono::duration<double>(writing).count(), std::chrono::duration<double, std::milli>(longest).count());
+			passed = passed && released > 0 && !held_too_long;
+			return true;
+		}
+
+		bool cycles(bool& passed)
+		{
+			const fs::path root = _settings.directory / "cycles";
+			for (std::size_t number = 0; number < 200; ++number)
+			{
+				fs::create_directories(root / ("d" + std::to_string(number % 20)));
+				write_file(root / ("d" + std::to_string(number % 20)) / ("f" + std::to_string(number)), "cycles", false);
+			}
+
+			// the module's options, journal included
+			filewatch::Options options = _options;
+			options.index = true;
+			options.journal = (_settings.directory / "cycles.journal").string();
+
+			std::atomic<std::uint64_t> events{0};
+			std::size_t unready = 0;
+			bool available = true;
+			const auto open_and_close = [&]() {
+				filewatch::FileWatch watch(root.string(), [&events](const filewatch::FileEvent&) { ++events; }, options);
+				available = watch.backend() == _options.backend;
+				if (!wait_ready(watch, 0)) ++unready;
+			};
+
+			// whatever the runtime brings up the first time around (sanitizer threads and the like) stays, the first
+			// watch is only there to get it out of the way
+			open_and_close();
+			if (!available) return false;
+			const std::pair<std::size_t, std::size_t> before = process_resources();
+
+			// a writer keeps the watches busy the whole time they come and go
+			std::atomic_bool stop{false};
+			std::thread writer([&root, &stop]() {
+				for (std::size_t number = 0; !stop; ++number)
+					write_file(root / ("d" + std::to_string(number % 20)) / ("f" + std::to_string(number % 200)), "x", true);
+			});
+
+			const Clock::time_point started = Clock::now();
+			for (std::size_t cycle = 0; cycle < _settings.cycles && available; ++cycle)
+				open_and_close();
+			stop = true;
+			writer.join();
+			if (!available) return false;
+
+			const std::pair<std::size_t, std::size_t> after = process_resources();
+			std::printf("    cycles: %zu watches opened and closed in %.2fs, %llu events, %zu never got ready, %zu -> %zu descriptors, %zu -> %zu threads\n",
+				_settings.cycles, std::chrono::duration<double>(Clock::now() - started).count(), static_cast<unsigned long long>(events.load()),
+				unready, before.first, after.first, before.second, after.second);
+			passed = passed && unready == 0 && after.first <= before.first && after.second <= before.second;
+			return true;
+		}
+
+		const Settings& _settings;
+		const filewatch::Options _options;
+	};
+
+	bool parse_arguments(int argc, char** argv, Settings& settings)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string argument = argv[i];
+			const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+			if (value == nullptr) return false;
+			++i;
+
+			if (argument == "--threads")
+				settings.threads = std::strtoull(value, nullptr, 10);
+			else if (argument == "--files")
+				settings.files = std::strtoull(value, nullptr, 10);
+			else if (argument == "--rounds")
+				settings.rounds = std::strtoull(value, nullptr, 10);
+			else if (argument == "--cycles")
+				settings.cycles = std::strtoull(value, nullptr, 10);
+			else if (argument == "--backend")
+				settings.backend = value;
+			else if (argument == "--scenario")
+				settings.scenario = value;
+			else if (argument == "--dir")
+				settings.directory = value;
+			else
+				return false;
+		}
+
+		return settings.threads > 0 && settings.files > 0 && settings.rounds > 0;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Settings settings;
+	if (!parse_arguments(argc, argv, settings))
+	{
+		std::fprintf(stderr, "usage: %s [--threads N] [--files N] [--rounds N] [--cycles N] [--backend all|native|fanotify]\n"
+			"       [--scenario all|lifecycle|tree|renames|saves|coalesce|cycles] [--dir path]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<filewatch::Backend> backends;
+	if (settings.backend == "all" || settings.backend == "native")
+		backends.push_back(filewatch::Backend::NATIVE);
+	if (settings.backend == "all" || settings.backend == "fanotify")
+		backends.push_back(filewatch::Backend::FANOTIFY);
+
+	bool passed = true;
+	try
+	{
+		for (const filewatch::Backend backend : backends)
+		{
+			for (const filewatch::Delivery delivery : { filewatch::Delivery::DIRECT, filewatch::Delivery::THREADED })
+			{
+				const char* backend_name = backend == filewatch::Backend::FANOTIFY ? "fanotify" : "native";
+				const char* delivery_name = delivery == filewatch::Delivery::DIRECT ? "direct" : "threaded";
+				std::printf("%s backend, %s delivery, %zu threads x %zu files\n", backend_name, delivery_name, settings.threads, settings.files);
+
+				filewatch::Options options{};
+				options.backend = backend;
+				options.delivery = delivery;
+				options.on_error = [](const std::string& message) { std::fprintf(stderr, "    %s\n", message.c_str()); };
+				bool run_passed = true;
+				if (!Stress(settings, options).run(run_passed))
+				{
+					std::printf("    not available here, skipped\n");
+					continue;
+				}
+				std::printf("    %s\n", run_passed ? "passed" : "FAILED");
+				passed = passed && run_passed;
+			}
+		}
+	}
+	catch (const std::exception& exception)
+	{
+		std::fprintf(stderr, "stress test failed: %s\n", exception.what());
+		return 1;
+	}
+
+	return passed ? 0 : 1;
+}